@@ -0,0 +1,304 @@
+/*
+ * Copyright 2022 The OpenSSL Project Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Ring buffer BIO for transports that run in the same process as libssl,
+ * such as a userspace TCP stack. Besides the usual BIO_read() and
+ * BIO_write(), which copy, the ring lends contiguous regions of its memory:
+ * the transport receives ciphertext straight into the ring and transmits
+ * straight out of it, and the record layer encrypts records straight into
+ * the ring used as the write BIO of an SSL.
+ */
+
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include "internal/bio.h"
+#include "ssl_local.h"
+
+/* Enough for a few records of the largest size */
+#define RING_DEFAULT_SIZE       (4 * SSL3_RT_MAX_PACKET_SIZE)
+
+typedef struct bio_ring_st {
+    unsigned char *buf;
+    size_t size;
+    /* Offset of the first byte held */
+    size_t head;
+    /* Number of bytes held */
+    size_t len;
+    /* Value BIO_read() returns when the ring is empty */
+    int eof_ret;
+} BIO_RING;
+
+static int ring_write(BIO *b, const char *data, size_t dlen, size_t *written);
+static int ring_read(BIO *b, char *data, size_t dlen, size_t *readbytes);
+static int ring_puts(BIO *b, const char *str);
+static long ring_ctrl(BIO *b, int cmd, long num, void *ptr);
+static int ring_new(BIO *b);
+static int ring_free(BIO *b);
+
+static const BIO_METHOD methods_ring = {
+    BIO_TYPE_RING,
+    "ring buffer",
+    ring_write,
+    NULL,                       /* ring_write_old, */
+    ring_read,
+    NULL,                       /* ring_read_old,  */
+    ring_puts,
+    NULL,                       /* ring_gets,      */
+    ring_ctrl,
+    ring_new,
+    ring_free,
+    NULL,                       /* ring_callback_ctrl */
+};
+
+const BIO_METHOD *BIO_s_ring(void)
+{
+    return &methods_ring;
+}
+
+static int ring_resize(BIO_RING *ring, size_t size)
+{
+    unsigned char *buf;
+
+    if (size == 0 || ring->len > 0) {
+        ERR_raise(ERR_LIB_BIO, ERR_R_PASSED_INVALID_ARGUMENT);
+        return 0;
+    }
+    if ((buf = OPENSSL_malloc(size)) == NULL) {
+        ERR_raise(ERR_LIB_BIO, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    OPENSSL_free(ring->buf);
+    ring->buf = buf;
+    ring->size = size;
+    ring->head = 0;
+    return 1;
+}
+
+static int ring_new(BIO *b)
+{
+    BIO_RING *ring = OPENSSL_zalloc(sizeof(*ring));
+
+    if (ring == NULL) {
+        ERR_raise(ERR_LIB_BIO, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    if (!ring_resize(ring, RING_DEFAULT_SIZE)) {
+        OPENSSL_free(ring);
+        return 0;
+    }
+    /* Like a memory BIO, an empty ring asks to retry */
+    ring->eof_ret = -1;
+    BIO_set_data(b, ring);
+    BIO_set_init(b, 1);
+    return 1;
+}
+
+static int ring_free(BIO *b)
+{
+    BIO_RING *ring;
+
+    if (b == NULL)
+        return 0;
+    ring = BIO_get_data(b);
+    if (ring != NULL) {
+        OPENSSL_free(ring->buf);
+        OPENSSL_free(ring);
+    }
+    BIO_set_data(b, NULL);
+    BIO_set_init(b, 0);
+    return 1;
+}
+
+BIO *BIO_new_ring(size_t size)
+{
+    BIO *b = BIO_new(BIO_s_ring());
+
+    if (b != NULL && size != RING_DEFAULT_SIZE
+            && !ring_resize(BIO_get_data(b), size)) {
+        BIO_free(b);
+        return NULL;
+    }
+    return b;
+}
+
+/* Offset and length of the contiguous free space after the held bytes */
+static size_t ring_tail(BIO_RING *ring, size_t *off)
+{
+    /* Start over at the beginning while empty, to lend as much as possible */
+    if (ring->len == 0)
+        ring->head = 0;
+    *off = (ring->head + ring->len) % ring->size;
+    if (*off < ring->head || ring->len == ring->size)
+        return ring->size - ring->len;
+    return ring->size - *off;
+}
+
+/*
+ * Lends the contiguous free space of the ring as |*buf|, and returns its
+ * length. The bytes written there are added to the ring by
+ * BIO_ring_write_commit().
+ */
+size_t BIO_ring_write_buf(BIO *b, unsigned char **buf)
+{
+    BIO_RING *ring = BIO_get_data(b);
+    size_t off, len;
+
+    len = ring_tail(ring, &off);
+    *buf = ring->buf + off;
+    return len;
+}
+
+int BIO_ring_write_commit(BIO *b, size_t n)
+{
+    BIO_RING *ring = BIO_get_data(b);
+    size_t off;
+
+    if (n > ring_tail(ring, &off)) {
+        ERR_raise(ERR_LIB_BIO, ERR_R_PASSED_INVALID_ARGUMENT);
+        return 0;
+    }
+    ring->len += n;
+    return 1;
+}
+
+/*
+ * Lends the contiguous bytes at the start of the ring as |*buf|, and returns
+ * their number. The bytes consumed there are removed from the ring by
+ * BIO_ring_read_commit().
+ */
+size_t BIO_ring_read_buf(BIO *b, const unsigned char **buf)
+{
+    BIO_RING *ring = BIO_get_data(b);
+
+    *buf = ring->buf + ring->head;
+    if (ring->head + ring->len > ring->size)
+        return ring->size - ring->head;
+    return ring->len;
+}
+
+int BIO_ring_read_commit(BIO *b, size_t n)
+{
+    BIO_RING *ring = BIO_get_data(b);
+    const unsigned char *buf;
+
+    if (n > BIO_ring_read_buf(b, &buf)) {
+        ERR_raise(ERR_LIB_BIO, ERR_R_PASSED_INVALID_ARGUMENT);
+        return 0;
+    }
+    ring->head = (ring->head + n) % ring->size;
+    ring->len -= n;
+    return 1;
+}
+
+static int ring_write(BIO *b, const char *data, size_t dlen, size_t *written)
+{
+    unsigned char *buf;
+    size_t n;
+
+    BIO_clear_retry_flags(b);
+    *written = 0;
+    while (*written < dlen && (n = BIO_ring_write_buf(b, &buf)) > 0) {
+        if (n > dlen - *written)
+            n = dlen - *written;
+        memcpy(buf, data + *written, n);
+        BIO_ring_write_commit(b, n);
+        *written += n;
+    }
+    if (*written == 0 && dlen > 0) {
+        BIO_set_retry_write(b);
+        return -1;
+    }
+    return 1;
+}
+
+static int ring_read(BIO *b, char *data, size_t dlen, size_t *readbytes)
+{
+    BIO_RING *ring = BIO_get_data(b);
+    const unsigned char *buf;
+    size_t n;
+
+    BIO_clear_retry_flags(b);
+    *readbytes = 0;
+    if (ring->len == 0) {
+        if (ring->eof_ret != 0)
+            BIO_set_retry_read(b);
+        return ring->eof_ret < 0 ? -1 : 0;
+    }
+    while (*readbytes < dlen && (n = BIO_ring_read_buf(b, &buf)) > 0) {
+        if (n > dlen - *readbytes)
+            n = dlen - *readbytes;
+        memcpy(data + *readbytes, buf, n);
+        BIO_ring_read_commit(b, n);
+        *readbytes += n;
+    }
+    return 1;
+}
+
+static int ring_puts(BIO *b, const char *str)
+{
+    size_t written;
+
+    if (ring_write(b, str, strlen(str), &written) <= 0)
+        return -1;
+    return (int)written;
+}
+
+static long ring_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+    BIO_RING *ring = BIO_get_data(b);
+
+    switch (cmd) {
+    case BIO_CTRL_RESET:
+        ring->head = ring->len = 0;
+        return 1;
+    case BIO_CTRL_EOF:
+        return ring->len == 0 && ring->eof_ret == 0;
+    case BIO_C_SET_BUF_MEM_EOF_RETURN:
+        ring->eof_ret = (int)num;
+        return 1;
+    case BIO_CTRL_PENDING:
+        return (long)ring->len;
+    case BIO_CTRL_WPENDING:
+        return 0;
+    case BIO_C_SET_WRITE_BUF_SIZE:
+        return ring_resize(ring, (size_t)num);
+    case BIO_C_GET_WRITE_BUF_SIZE:
+        return (long)ring->size;
+    case BIO_C_GET_WRITE_GUARANTEE:
+        return (long)(ring->size - ring->len);
+    case BIO_CTRL_GET_CLOSE:
+        return BIO_get_shutdown(b);
+    case BIO_CTRL_SET_CLOSE:
+        BIO_set_shutdown(b, (int)num);
+        return 1;
+    case BIO_CTRL_DUP:
+    case BIO_CTRL_FLUSH:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Lends |len| bytes of the ring that is the write BIO of |s| to the record
+ * layer, or returns NULL if |s| does not write to a ring or the ring has no
+ * contiguous space that large. The records written there are added to the
+ * ring with BIO_ring_write_commit().
+ */
+unsigned char *ssl_ring_lend_wbuf(SSL *s, size_t len)
+{
+    unsigned char *buf;
+
+    if (s->wbio == NULL || BIO_method_type(s->wbio) != BIO_TYPE_RING
+            || BIO_ring_write_buf(s->wbio, &buf) < len)
+        return NULL;
+    return buf;
+}
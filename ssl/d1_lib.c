@@ -13,7 +13,6 @@
 #include <openssl/rand.h>
 #include "ssl_local.h"
 
-static void get_current_time(struct timeval *t);
 static int dtls1_handshake_write(SSL *s);
 static size_t dtls1_link_min_mtu(void);
 
@@ -282,7 +281,7 @@ void dtls1_start_timer(SSL *s)
     }
 
     /* Set timeout to current time */
-    get_current_time(&(s->d1->next_timeout));
+    ssl_get_current_time(&(s->d1->next_timeout));
 
     /* Add duration to current time */
 
@@ -311,7 +310,7 @@ struct timeval *dtls1_get_timeout(SSL *s, struct timeval *timeleft)
     }
 
     /* Get current time */
-    get_current_time(&timenow);
+    ssl_get_current_time(&timenow);
 
     /* If timer already expired, set remaining time to 0 */
     if (s->d1->next_timeout.tv_sec < timenow.tv_sec ||
@@ -424,32 +423,6 @@ int dtls1_handle_timeout(SSL *s)
     return dtls1_retransmit_buffered_messages(s);
 }
 
-static void get_current_time(struct timeval *t)
-{
-#if defined(_WIN32)
-    SYSTEMTIME st;
-    union {
-        unsigned __int64 ul;
-        FILETIME ft;
-    } now;
-
-    GetSystemTime(&st);
-    SystemTimeToFileTime(&st, &now.ft);
-    /* re-bias to 1/1/1970 */
-# ifdef  __MINGW32__
-    now.ul -= 116444736000000000ULL;
-# else
-    /* *INDENT-OFF* */
-    now.ul -= 116444736000000000UI64;
-    /* *INDENT-ON* */
-# endif
-    t->tv_sec = (long)(now.ul / 10000000);
-    t->tv_usec = ((int)(now.ul % 10000000)) / 10;
-#else
-    gettimeofday(t, NULL);
-#endif
-}
-
 #define LISTEN_SUCCESS              2
 #define LISTEN_SEND_VERIFY_REQUEST  1
 
@@ -109,6 +109,74 @@ void RECORD_LAYER_reset_write_sequence(RECORD_LAYER *rl)
     memset(rl->write_sequence, 0, sizeof(rl->write_sequence));
 }
 
+/*
+ * Points |*data| at the unread part of the current decrypted application data
+ * record, without copying it out of the read buffer. Returns 1 on success or
+ * 0 if no application data has been processed yet.
+ */
+int ssl3_read_borrow(SSL *s, const unsigned char **data, size_t *len)
+{
+    size_t curr_rec = 0, num_recs = RECORD_LAYER_get_numrpipes(&s->rlayer);
+    SSL3_RECORD *rr = s->rlayer.rrec;
+
+    while (curr_rec < num_recs && SSL3_RECORD_is_read(&rr[curr_rec]))
+        curr_rec++;
+    if (curr_rec == num_recs)
+        return 0;
+    rr = &rr[curr_rec];
+    if (SSL3_RECORD_get_type(rr) != SSL3_RT_APPLICATION_DATA
+            || SSL3_RECORD_get_length(rr) == 0)
+        return 0;
+
+    *data = &rr->data[rr->off];
+    *len = SSL3_RECORD_get_length(rr);
+    return 1;
+}
+
+/*
+ * Consumes |len| bytes of the record returned by ssl3_read_borrow(), exactly
+ * as a non-peek ssl3_read_bytes() of |len| bytes would have done.
+ */
+int ssl3_read_release(SSL *s, size_t len)
+{
+    SSL3_RECORD *rr;
+    const unsigned char *data;
+    size_t avail;
+
+    if (!ssl3_read_borrow(s, &data, &avail))
+        return len == 0;
+    if (len > avail)
+        return 0;
+
+    rr = &s->rlayer.rrec[0];
+    while (SSL3_RECORD_is_read(rr))
+        rr++;
+    if (s->options & SSL_OP_CLEANSE_PLAINTEXT)
+        OPENSSL_cleanse(&(rr->data[rr->off]), len);
+    SSL3_RECORD_sub_length(rr, len);
+    SSL3_RECORD_add_off(rr, len);
+    if (SSL3_RECORD_get_length(rr) == 0) {
+        s->rlayer.rstate = SSL_ST_READ_HEADER;
+        SSL3_RECORD_set_off(rr, 0);
+        SSL3_RECORD_set_read(rr);
+        if (!RECORD_LAYER_processed_read_pending(&s->rlayer)
+                && (s->mode & SSL_MODE_RELEASE_BUFFERS)
+                && SSL3_BUFFER_get_left(&s->rlayer.rbuf) == 0)
+            ssl3_release_read_buffer(s);
+    }
+    return 1;
+}
+
+/*
+ * Returns 1 if the record layer holds the records it read last, which
+ * ssl3_read_bytes() keeps when it returns application data, or an empty
+ * record for a zero length read. Returns 0 if it failed to read a record.
+ */
+int ssl3_read_has_record(const SSL *s)
+{
+    return RECORD_LAYER_get_numrpipes(&s->rlayer) > 0;
+}
+
 size_t ssl3_pending(const SSL *s)
 {
     size_t i, num = 0;
@@ -143,6 +211,24 @@ void SSL_CTX_set_default_read_buffer_len(SSL_CTX *ctx, size_t len)
     ctx->default_read_buf_len = len;
 }
 
+/*
+ * Enables adaptive read buffer sizing for the TLS connections of |ctx|, or
+ * disables it if |max| is 0. The connections then read ahead, up to a window
+ * of between |min| and |max| bytes beyond the current record. The window
+ * grows while reads keep filling the buffer and shrinks while they don't,
+ * and the buffer of a connection that stays idle is freed.
+ */
+int SSL_CTX_set_read_buffer_bounds(SSL_CTX *ctx, size_t min, size_t max)
+{
+    if (max != 0 && (min == 0 || min > max)) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_PASSED_INVALID_ARGUMENT);
+        return 0;
+    }
+    ctx->read_buf_min = min;
+    ctx->read_buf_max = max;
+    return 1;
+}
+
 void SSL_set_default_read_buffer_len(SSL *s, size_t len)
 {
     SSL3_BUFFER_set_default_len(RECORD_LAYER_get_rbuf(&s->rlayer), len);
@@ -176,6 +262,60 @@ const char *SSL_rstate_string(const SSL *s)
     }
 }
 
+/* Consecutive reads after which the read-ahead window is grown or shrunk */
+#define READ_FILLS_TO_GROW      2
+#define READ_SPARSE_TO_SHRINK   8
+
+/*
+ * Adjusts the read-ahead window of |s| after a read of |bioread| bytes into
+ * |avail| bytes of space. Reads that fill the buffer mean more data is
+ * waiting, so the window doubles. Reads that fill little of the window mean
+ * the buffer is mostly unused, so it halves. The new size takes effect when
+ * the buffer is next empty.
+ */
+static void ssl3_read_adapt(SSL *s, size_t window, size_t bioread,
+                            size_t avail)
+{
+    RECORD_LAYER *rl = &s->rlayer;
+
+    if (bioread == avail && avail >= window) {
+        rl->read_sparse = 0;
+        if (++rl->read_fills >= READ_FILLS_TO_GROW) {
+            rl->read_fills = 0;
+            rl->read_window = window > s->ctx->read_buf_max / 2
+                              ? s->ctx->read_buf_max : window * 2;
+        }
+    } else if (bioread <= window / 4) {
+        rl->read_fills = 0;
+        if (++rl->read_sparse >= READ_SPARSE_TO_SHRINK) {
+            rl->read_sparse = 0;
+            rl->read_window = window / 2 < s->ctx->read_buf_min
+                              ? s->ctx->read_buf_min : window / 2;
+        }
+    } else {
+        rl->read_fills = rl->read_sparse = 0;
+    }
+}
+
+/*
+ * Called when a read found nothing and nothing is buffered. Returns 1 if the
+ * read buffer of |s| should be freed until data arrives again, which is once
+ * the window has shrunk to its lower bound and reads keep finding little.
+ */
+static int ssl3_read_idle(SSL *s, size_t window)
+{
+    RECORD_LAYER *rl = &s->rlayer;
+
+    if (window == 0)
+        return 0;
+    rl->read_fills = 0;
+    if (window > s->ctx->read_buf_min
+            || ++rl->read_sparse < READ_SPARSE_TO_SHRINK)
+        return 0;
+    rl->read_sparse = 0;
+    return 1;
+}
+
 /*
  * Return values are as per SSL_read()
  */
@@ -191,7 +331,7 @@ int ssl3_read_n(SSL *s, size_t n, size_t max, int extend, int clearold,
      * if clearold == 1, move the packet to the start of the buffer; if
      * clearold == 0 then leave any old packets where they were
      */
-    size_t len, left, align = 0;
+    size_t len, left, align = 0, window;
     unsigned char *pkt;
     SSL3_BUFFER *rb;
 
@@ -199,6 +339,14 @@ int ssl3_read_n(SSL *s, size_t n, size_t max, int extend, int clearold,
         return 0;
 
     rb = &s->rlayer.rbuf;
+    /*
+     * With adaptive sizing, the buffer follows the read-ahead window. It is
+     * only replaced when it holds nothing and a new batch of records starts.
+     */
+    window = ssl3_read_window(s);
+    if (window > 0 && rb->buf != NULL && !extend && clearold
+            && rb->left == 0 && rb->len != ssl3_read_buffer_len(s))
+        ssl3_release_read_buffer(s);
     if (rb->buf == NULL)
         if (!ssl3_setup_read_buffer(s)) {
             /* SSLfatal() already called */
@@ -264,10 +412,11 @@ int ssl3_read_n(SSL *s, size_t n, size_t max, int extend, int clearold,
 
     /*
      * Ktls always reads full records.
-     * Also, we always act like read_ahead is set for DTLS.
+     * Also, we always act like read_ahead is set for DTLS, and with adaptive
+     * sizing.
      */
     if (!BIO_get_ktls_recv(s->rbio) && !s->rlayer.read_ahead
-        && !SSL_IS_DTLS(s)) {
+        && !SSL_IS_DTLS(s) && window == 0) {
         /* ignore max parameter */
         max = n;
     } else {
@@ -315,11 +464,15 @@ int ssl3_read_n(SSL *s, size_t n, size_t max, int extend, int clearold,
 
         if (ret <= 0) {
             rb->left = left;
-            if (s->mode & SSL_MODE_RELEASE_BUFFERS && !SSL_IS_DTLS(s))
-                if (len + left == 0)
-                    ssl3_release_read_buffer(s);
+            if (len + left == 0 && !SSL_IS_DTLS(s)
+                    && ((s->mode & SSL_MODE_RELEASE_BUFFERS) != 0
+                        || ssl3_read_idle(s, window)))
+                ssl3_release_read_buffer(s);
             return ret;
         }
+        /* Only reads for a new record can read ahead */
+        if (window > 0 && !extend)
+            ssl3_read_adapt(s, window, bioread, max - left);
         left += bioread;
         /*
          * reads should *never* span multiple packets for DTLS because the
@@ -573,7 +726,8 @@ int ssl3_write_bytes(SSL *s, int type, const void *buf_, size_t len,
      * If max_pipelines is 0 then this means "undefined" and we default to
      * 1 pipeline. Similarly if the cipher does not support pipelined
      * processing then we also only use 1 pipeline, or if we're not using
-     * explicit IVs
+     * explicit IVs. TLSv1.3 records can always be pipelined if there is an
+     * executor to encrypt them in parallel.
      */
     maxpipes = s->max_pipelines;
     if (maxpipes > SSL_MAX_PIPELINES) {
@@ -586,9 +740,12 @@ int ssl3_write_bytes(SSL *s, int type, const void *buf_, size_t len,
     }
     if (maxpipes == 0
         || s->enc_write_ctx == NULL
-        || (EVP_CIPHER_get_flags(EVP_CIPHER_CTX_get0_cipher(s->enc_write_ctx))
-            & EVP_CIPH_FLAG_PIPELINE) == 0
-        || !SSL_USE_EXPLICIT_IV(s))
+        || (((EVP_CIPHER_get_flags(EVP_CIPHER_CTX_get0_cipher(s->enc_write_ctx))
+              & EVP_CIPH_FLAG_PIPELINE) == 0
+             || !SSL_USE_EXPLICIT_IV(s))
+            && (!SSL_TREAT_AS_TLS13(s)
+                || s->ctx->record_parallel_cb == NULL
+                || BIO_get_ktls_send(s->wbio))))
         maxpipes = 1;
     if (max_send_fragment == 0
             || split_send_fragment == 0
@@ -679,6 +836,8 @@ int do_ssl3_write(SSL *s, int type, const unsigned char *buf,
     SSL_SESSION *sess;
     size_t totlen = 0, len, wpinited = 0;
     size_t j;
+    /* Our own write buffer while records are written into a ring BIO */
+    unsigned char *ownbuf = NULL, *ringbuf;
 
     for (j = 0; j < numpipes; j++)
         totlen += pipelens[j];
@@ -726,6 +885,13 @@ int do_ssl3_write(SSL *s, int type, const unsigned char *buf,
         }
     }
 
+    /* Key evolution ciphers don't pipeline, so this covers the whole write */
+    if ((s->mac_flags & SSL_MAC_FLAG_WRITE_KEY_EVOLUTION) != 0
+            && !tls1_key_evolution_check(s, 1)) {
+        /* SSLfatal() already called */
+        goto err;
+    }
+
     /*
      * 'create_empty_fragment' is true only when this function calls itself
      */
@@ -810,10 +976,24 @@ int do_ssl3_write(SSL *s, int type, const unsigned char *buf,
             thispkt = &pkt[j];
 
             wb = &s->rlayer.wbuf[j];
+            if (numpipes == 1
+                    && (ringbuf = ssl_ring_lend_wbuf(s,
+                                                     SSL3_BUFFER_get_len(wb)))
+                       != NULL) {
+                /*
+                 * Encrypt straight into the ring. The record must start at
+                 * the lent address, so there is no room for alignment.
+                 */
+                ownbuf = SSL3_BUFFER_get_buf(wb);
+                SSL3_BUFFER_set_buf(wb, ringbuf);
+                align = 0;
+            } else {
 #if defined(SSL3_ALIGN_PAYLOAD) && SSL3_ALIGN_PAYLOAD != 0
-            align = (size_t)SSL3_BUFFER_get_buf(wb) + SSL3_RT_HEADER_LENGTH;
-            align = SSL3_ALIGN_PAYLOAD - 1 - ((align - 1) % SSL3_ALIGN_PAYLOAD);
+                align = (size_t)SSL3_BUFFER_get_buf(wb) + SSL3_RT_HEADER_LENGTH;
+                align = SSL3_ALIGN_PAYLOAD - 1
+                        - ((align - 1) % SSL3_ALIGN_PAYLOAD);
 #endif
+            }
             SSL3_BUFFER_set_offset(wb, align);
             if (!WPACKET_init_static_len(thispkt, SSL3_BUFFER_get_buf(wb),
                                          SSL3_BUFFER_get_len(wb), 0)
@@ -1149,11 +1329,28 @@ int do_ssl3_write(SSL *s, int type, const unsigned char *buf,
     s->rlayer.wpend_type = type;
     s->rlayer.wpend_ret = totlen;
 
+    if (ownbuf != NULL) {
+        /* The record is already in the ring, it only needs adding */
+        wb = &s->rlayer.wbuf[0];
+        if (!BIO_ring_write_commit(s->wbio, SSL3_BUFFER_get_left(wb))) {
+            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+            goto err;
+        }
+        SSL3_BUFFER_set_left(wb, 0);
+        SSL3_BUFFER_set_buf(wb, ownbuf);
+        *written = totlen;
+        return 1;
+    }
+
     /* we now just need to write the buffer */
     return ssl3_write_pending(s, type, buf, totlen, written);
  err:
     for (j = 0; j < wpinited; j++)
         WPACKET_cleanup(&pkt[j]);
+    if (ownbuf != NULL) {
+        SSL3_BUFFER_set_left(&s->rlayer.wbuf[0], 0);
+        SSL3_BUFFER_set_buf(&s->rlayer.wbuf[0], ownbuf);
+    }
     return -1;
 }
 
@@ -1280,6 +1477,10 @@ int ssl3_read_bytes(SSL *s, int type, int *recvd_type, unsigned char *buf,
 
     rbuf = &s->rlayer.rbuf;
 
+    /* The peer may be waiting for a held Finished before it answers */
+    if (!ssl_release_finished(s))
+        return -1;
+
     if (!SSL3_BUFFER_is_initialised(rbuf)) {
         /* Not initialized yet */
         if (!ssl3_setup_read_buffer(s)) {
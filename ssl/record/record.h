@@ -134,6 +134,13 @@ typedef struct record_layer_st {
      * non-blocking reads)
      */
     int read_ahead;
+    /*
+     * Adaptive read-ahead: bytes to read beyond the current record, and how
+     * many consecutive reads filled the buffer or came back nearly empty
+     */
+    size_t read_window;
+    unsigned int read_fills;
+    unsigned int read_sparse;
     /* where we are when reading */
     int rstate;
     /* How many pipelines can be used to read data */
@@ -191,6 +198,7 @@ typedef struct ssl_mac_buf_st SSL_MAC_BUF;
 #define RECORD_LAYER_get_packet(rl)             ((rl)->packet)
 #define RECORD_LAYER_get_packet_length(rl)      ((rl)->packet_length)
 #define RECORD_LAYER_add_packet_length(rl, inc) ((rl)->packet_length += (inc))
+#define RECORD_LAYER_set_wnum(rl, n)            ((rl)->wnum = (n))
 #define DTLS_RECORD_LAYER_get_w_epoch(rl)       ((rl)->d->w_epoch)
 #define DTLS_RECORD_LAYER_get_processed_rcds(rl) \
                                                 ((rl)->d->processed_rcds)
@@ -218,6 +226,9 @@ int do_ssl3_write(SSL *s, int type, const unsigned char *buf,
 __owur int ssl3_read_bytes(SSL *s, int type, int *recvd_type,
                            unsigned char *buf, size_t len, int peek,
                            size_t *readbytes);
+__owur int ssl3_read_borrow(SSL *s, const unsigned char **data, size_t *len);
+__owur int ssl3_read_release(SSL *s, size_t len);
+__owur int ssl3_read_has_record(const SSL *s);
 __owur int ssl3_setup_buffers(SSL *s);
 __owur int ssl3_enc(SSL *s, SSL3_RECORD *inrecs, size_t n_recs, int send,
                     SSL_MAC_BUF *mac, size_t macsize);
@@ -34,13 +34,27 @@ void SSL3_BUFFER_release(SSL3_BUFFER *b)
     b->buf = NULL;
 }
 
-int ssl3_setup_read_buffer(SSL *s)
+/*
+ * Returns the current read-ahead window of |s|, which is 0 unless the
+ * SSL_CTX sets bounds for adaptive read buffer sizing. The window starts at
+ * the lower bound and is adjusted by ssl3_read_n().
+ */
+size_t ssl3_read_window(SSL *s)
 {
-    unsigned char *p;
-    size_t len, align = 0, headerlen;
-    SSL3_BUFFER *b;
+    if (s->ctx->read_buf_max == 0 || SSL_IS_DTLS(s)
+            || (s->rbio != NULL && BIO_get_ktls_recv(s->rbio)))
+        return 0;
+    if (s->rlayer.read_window < s->ctx->read_buf_min
+            || s->rlayer.read_window > s->ctx->read_buf_max)
+        s->rlayer.read_window = s->ctx->read_buf_min;
+    return s->rlayer.read_window;
+}
 
-    b = RECORD_LAYER_get_rbuf(&s->rlayer);
+/* Returns the size of the read buffer that |s| needs now */
+size_t ssl3_read_buffer_len(SSL *s)
+{
+    size_t len, align = 0, headerlen;
+    SSL3_BUFFER *b = RECORD_LAYER_get_rbuf(&s->rlayer);
 
     if (SSL_IS_DTLS(s))
         headerlen = DTLS1_RT_HEADER_LENGTH;
@@ -51,21 +65,37 @@ int ssl3_setup_read_buffer(SSL *s)
     align = (-SSL3_RT_HEADER_LENGTH) & (SSL3_ALIGN_PAYLOAD - 1);
 #endif
 
-    if (b->buf == NULL) {
-        len = SSL3_RT_MAX_PLAIN_LENGTH
-            + SSL3_RT_MAX_ENCRYPTED_OVERHEAD + headerlen + align;
+    len = SSL3_RT_MAX_PLAIN_LENGTH
+        + SSL3_RT_MAX_ENCRYPTED_OVERHEAD + headerlen + align;
 #ifndef OPENSSL_NO_COMP
-        if (ssl_allow_compression(s))
-            len += SSL3_RT_MAX_COMPRESSED_OVERHEAD;
+    if (ssl_allow_compression(s))
+        len += SSL3_RT_MAX_COMPRESSED_OVERHEAD;
 #endif
 
-        /* Ensure our buffer is large enough to support all our pipelines */
-        if (s->max_pipelines > 1)
-            len *= s->max_pipelines;
+    /* Ensure our buffer is large enough to support all our pipelines */
+    if (s->max_pipelines > 1)
+        len *= s->max_pipelines;
+
+    /* Room for the adaptive read-ahead beyond a full record */
+    len += ssl3_read_window(s);
+
+    if (b->default_len > len)
+        len = b->default_len;
+    return len;
+}
+
+int ssl3_setup_read_buffer(SSL *s)
+{
+    unsigned char *p;
+    size_t len;
+    SSL3_BUFFER *b;
+
+    b = RECORD_LAYER_get_rbuf(&s->rlayer);
 
-        if (b->default_len > len)
-            len = b->default_len;
-        if ((p = OPENSSL_malloc(len)) == NULL) {
+    if (b->buf == NULL) {
+        len = ssl3_read_buffer_len(s);
+        if ((p = ssl_conn_res_take_buf(s, 0, len)) == NULL
+                && (p = OPENSSL_malloc(len)) == NULL) {
             /*
              * We've got a malloc failure, and we're still initialising buffers.
              * We assume we're so doomed that we won't even be able to send an
@@ -126,7 +156,9 @@ int ssl3_setup_write_buffer(SSL *s, size_t numwpipes, size_t len)
 
         if (thiswb->buf == NULL) {
             if (s->wbio == NULL || !BIO_get_ktls_send(s->wbio)) {
-                p = OPENSSL_malloc(len);
+                p = ssl_conn_res_take_buf(s, 1, len);
+                if (p == NULL)
+                    p = OPENSSL_malloc(len);
                 if (p == NULL) {
                     s->rlayer.numwpipes = currpipe;
                     /*
@@ -157,6 +157,14 @@ int early_data_count_ok(SSL *s, size_t length, size_t overhead, int send)
 #define MAX_EMPTY_RECORDS 32
 
 #define SSL2_RT_HEADER_LENGTH   2
+
+/* Whether |s| accepts an SSLv2 compatible ClientHello as its first record */
+#ifdef OPENSSL_BTLS_PROFILE
+# define SSL2_HELLO_ACCEPTED(s)  0
+#else
+# define SSL2_HELLO_ACCEPTED(s)  ((s)->server)
+#endif
+
 /*-
  * Call this to get new input records.
  * It will return <= 0 if more data is needed, normally due to an error
@@ -250,7 +258,8 @@ int ssl3_get_record(SSL *s)
             /*
              * The first record received by the server may be a V2ClientHello.
              */
-            if (s->server && RECORD_LAYER_is_first_record(&s->rlayer)
+            if (SSL2_HELLO_ACCEPTED(s)
+                    && RECORD_LAYER_is_first_record(&s->rlayer)
                     && (sslv2len & 0x8000) != 0
                     && (type == SSL2_MT_CLIENT_HELLO)) {
                 /*
@@ -525,6 +534,12 @@ int ssl3_get_record(SSL *s)
     if (BIO_get_ktls_recv(s->rbio) && !is_ktls_left)
         goto skip_decryption;
 
+    if ((s->mac_flags & SSL_MAC_FLAG_READ_KEY_EVOLUTION) != 0
+            && !tls1_key_evolution_check(s, 0)) {
+        /* SSLfatal() already called */
+        return -1;
+    }
+
     if (s->read_hash != NULL) {
         const EVP_MD *tmpmd = EVP_MD_CTX_get0_md(s->read_hash);
 
@@ -1164,7 +1179,9 @@ int tls1_enc(SSL *s, SSL3_RECORD *recs, size_t n_recs, int sending,
             /*
              * When sending, seq is incremented after MAC calculation.
              * So if we are in ETM mode, we use seq 'as is' in the ctrl-function.
-             * Otherwise we have to decrease it in the implementation
+             * Otherwise we have to decrease it in the implementation.
+             * Unlike the MAC key this can't be cached per TLSTREE leaf: the
+             * ctrl also re-aligns the CTR counter to |seq| for every record.
              */
             if (sending && !SSL_WRITE_ETM(s))
                 decrement_seq = 1;
@@ -1404,6 +1421,34 @@ int n_ssl3_mac(SSL *ssl, SSL3_RECORD *rec, unsigned char *md, int sending)
     return 1;
 }
 
+/*
+ * Returns a MAC context keyed for the TLSTREE leaf that |seq| falls in. The
+ * context is derived from the master MAC context |hash| only when the leaf
+ * changes, and is reused for all other records.
+ */
+static EVP_MD_CTX *tls1_tlstree_mac_ctx(SSL_TLSTREE *tree, EVP_MD_CTX *hash,
+                                        unsigned char *seq)
+{
+    unsigned char *p = seq;
+    uint64_t leaf;
+
+    n2l8(p, leaf);
+    leaf &= tree->mask;
+    if (tree->mac_ctx != NULL && tree->leaf == leaf)
+        return tree->mac_ctx;
+
+    if (tree->mac_ctx == NULL && (tree->mac_ctx = EVP_MD_CTX_new()) == NULL)
+        return NULL;
+    if (!EVP_MD_CTX_copy(tree->mac_ctx, hash)
+            || EVP_MD_CTX_ctrl(tree->mac_ctx, EVP_MD_CTRL_TLSTREE, 0, seq) <= 0) {
+        EVP_MD_CTX_free(tree->mac_ctx);
+        tree->mac_ctx = NULL;
+        return NULL;
+    }
+    tree->leaf = leaf;
+    return tree->mac_ctx;
+}
+
 int tls1_mac(SSL *ssl, SSL3_RECORD *rec, unsigned char *md, int sending)
 {
     unsigned char *seq;
@@ -1432,6 +1477,18 @@ int tls1_mac(SSL *ssl, SSL3_RECORD *rec, unsigned char *md, int sending)
         return 0;
     md_size = t;
 
+    /*
+     * For TLSTREE copy the per-record context from the cached leaf context
+     * rather than diversifying the master key again for every record.
+     */
+    if (!SSL_IS_DTLS(ssl) && tlstree_mac && !stream_mac) {
+        hash = tls1_tlstree_mac_ctx(sending ? &ssl->tlstree_write
+                                            : &ssl->tlstree_read,
+                                    hash, seq);
+        if (hash == NULL)
+            return 0;
+    }
+
     /* I should fix this up TLS TLS TLS TLS TLS XXXXXXXX */
     if (stream_mac) {
         mac_ctx = hash;
@@ -1443,7 +1500,8 @@ int tls1_mac(SSL *ssl, SSL3_RECORD *rec, unsigned char *md, int sending)
         mac_ctx = hmac;
     }
 
-    if (!SSL_IS_DTLS(ssl) && tlstree_mac && EVP_MD_CTX_ctrl(mac_ctx, EVP_MD_CTRL_TLSTREE, 0, seq) <= 0) {
+    if (!SSL_IS_DTLS(ssl) && tlstree_mac && stream_mac
+            && EVP_MD_CTX_ctrl(mac_ctx, EVP_MD_CTRL_TLSTREE, 0, seq) <= 0) {
         goto end;
     }
 
@@ -11,10 +11,166 @@
 #include "record_local.h"
 #include "internal/cryptlib.h"
 
+/*
+ * Encrypts or decrypts |rec| with |ctx| and the nonce |iv|. Returns 1 on
+ * success, 0 if the record is bad and -1 on internal error. Only touches
+ * |ctx| and |rec|, so that records can be processed on different threads.
+ */
+static int tls13_enc_rec(EVP_CIPHER_CTX *ctx, SSL3_RECORD *rec,
+                         const unsigned char *iv, size_t taglen, int ccm,
+                         int sending)
+{
+    unsigned char recheader[SSL3_RT_HEADER_LENGTH];
+    size_t hdrlen;
+    int lenu, lenf;
+    WPACKET wpkt;
+
+    if (!sending) {
+        /*
+         * Take off tag. There must be at least one byte of content type as
+         * well as the tag
+         */
+        if (rec->length < taglen + 1)
+            return 0;
+        rec->length -= taglen;
+    }
+
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, sending) <= 0
+            || (!sending && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG,
+                                             taglen,
+                                             rec->data + rec->length) <= 0))
+        return -1;
+
+    /* Set up the AAD */
+    if (!WPACKET_init_static_len(&wpkt, recheader, sizeof(recheader), 0)
+            || !WPACKET_put_bytes_u8(&wpkt, rec->type)
+            || !WPACKET_put_bytes_u16(&wpkt, rec->rec_version)
+            || !WPACKET_put_bytes_u16(&wpkt, rec->length + taglen)
+            || !WPACKET_get_total_written(&wpkt, &hdrlen)
+            || hdrlen != SSL3_RT_HEADER_LENGTH
+            || !WPACKET_finish(&wpkt)) {
+        WPACKET_cleanup(&wpkt);
+        return -1;
+    }
+
+    /*
+     * For CCM we must explicitly set the total plaintext length before we add
+     * any AAD.
+     */
+    if ((ccm && EVP_CipherUpdate(ctx, NULL, &lenu, NULL,
+                                 (unsigned int)rec->length) <= 0)
+            || EVP_CipherUpdate(ctx, NULL, &lenu, recheader,
+                                sizeof(recheader)) <= 0
+            || EVP_CipherUpdate(ctx, rec->data, &lenu, rec->input,
+                                (unsigned int)rec->length) <= 0
+            || EVP_CipherFinal_ex(ctx, rec->data + lenu, &lenf) <= 0
+            || (size_t)(lenu + lenf) != rec->length) {
+        return 0;
+    }
+    if (sending) {
+        /* Add the tag */
+        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, taglen,
+                                rec->data + rec->length) <= 0)
+            return -1;
+        rec->length += taglen;
+    }
+
+    return 1;
+}
+
+/*
+ * Sets |iv| to the nonce for the record with sequence number |seq|, and
+ * increments |seq|. Returns 0 if the sequence number wrapped.
+ */
+static int tls13_nonce(unsigned char *iv, const unsigned char *staticiv,
+                       size_t ivlen, unsigned char *seq)
+{
+    size_t offset = ivlen - SEQ_NUM_SIZE, loop;
+
+    memcpy(iv, staticiv, offset);
+    for (loop = 0; loop < SEQ_NUM_SIZE; loop++)
+        iv[offset + loop] = staticiv[offset + loop] ^ seq[loop];
+
+    /* Increment the sequence counter */
+    for (loop = SEQ_NUM_SIZE; loop > 0; loop--) {
+        ++seq[loop - 1];
+        if (seq[loop - 1] != 0)
+            break;
+    }
+    /* Zero if the sequence has wrapped */
+    return loop != 0;
+}
+
+/* A pipelined write, each record of which is a job for the executor */
+typedef struct {
+    EVP_CIPHER_CTX **ctx;
+    SSL3_RECORD *recs;
+    unsigned char iv[SSL_MAX_PIPELINES][EVP_MAX_IV_LENGTH];
+    int ret[SSL_MAX_PIPELINES];
+    size_t taglen;
+    int ccm;
+} TLS13_ENC_BATCH;
+
+static void tls13_enc_job(void *arg, size_t i)
+{
+    TLS13_ENC_BATCH *batch = arg;
+
+    batch->ret[i] = tls13_enc_rec(batch->ctx[i], &batch->recs[i],
+                                  batch->iv[i], batch->taglen, batch->ccm, 1);
+}
+
+/*
+ * Encrypts the |n_recs| records of a pipelined write in parallel, each with
+ * its own copy of the write context, using the executor of the SSL_CTX.
+ */
+static int tls13_enc_parallel(SSL *s, SSL3_RECORD *recs, size_t n_recs,
+                              size_t ivlen, size_t taglen, int ccm)
+{
+    TLS13_ENC_BATCH batch;
+    unsigned char *seq = RECORD_LAYER_get_write_sequence(&s->rlayer);
+    size_t i;
+
+    if (s->ctx->record_parallel_cb == NULL || n_recs > SSL_MAX_PIPELINES) {
+        /* Should not happen */
+        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+
+    for (i = 0; i < n_recs; i++) {
+        if (s->enc_write_pipe_ctx[i] == NULL
+                && (s->enc_write_pipe_ctx[i] = EVP_CIPHER_CTX_new()) == NULL) {
+            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_MALLOC_FAILURE);
+            return 0;
+        }
+        if (!EVP_CIPHER_CTX_copy(s->enc_write_pipe_ctx[i],
+                                 s->enc_write_ctx)) {
+            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+            return 0;
+        }
+        if (!tls13_nonce(batch.iv[i], s->write_iv, ivlen, seq))
+            return 0;
+    }
+    batch.ctx = s->enc_write_pipe_ctx;
+    batch.recs = recs;
+    batch.taglen = taglen;
+    batch.ccm = ccm;
+
+    s->ctx->record_parallel_cb(s->ctx->record_parallel_arg, tls13_enc_job,
+                               &batch, n_recs);
+
+    for (i = 0; i < n_recs; i++) {
+        if (batch.ret[i] <= 0) {
+            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /*-
  * tls13_enc encrypts/decrypts |n_recs| in |recs|. Calls SSLfatal on internal
  * error, but not otherwise. It is the responsibility of the caller to report
- * a bad_record_mac.
+ * a bad_record_mac. Only writes are pipelined, see tls13_enc_parallel().
  *
  * Returns:
  *    0: On failure
@@ -24,17 +180,15 @@ int tls13_enc(SSL *s, SSL3_RECORD *recs, size_t n_recs, int sending,
               ossl_unused SSL_MAC_BUF *mac, ossl_unused size_t macsize)
 {
     EVP_CIPHER_CTX *ctx;
-    unsigned char iv[EVP_MAX_IV_LENGTH], recheader[SSL3_RT_HEADER_LENGTH];
-    size_t taglen, offset, loop, hdrlen;
-    int ivlen;
+    unsigned char iv[EVP_MAX_IV_LENGTH];
+    size_t taglen;
+    int ivlen, ret;
     unsigned char *staticiv;
     unsigned char *seq;
-    int lenu, lenf;
     SSL3_RECORD *rec = &recs[0];
     uint32_t alg_enc;
-    WPACKET wpkt;
 
-    if (n_recs != 1) {
+    if (n_recs == 0 || (n_recs > 1 && !sending)) {
         /* Should not happen */
         SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
         return 0;
@@ -55,10 +209,15 @@ int tls13_enc(SSL *s, SSL3_RECORD *recs, size_t n_recs, int sending,
      * plaintext alerts. If we're reading and ctx != NULL then we allow
      * plaintext alerts at certain points in the handshake. If we've got this
      * far then we have already validated that a plaintext alert is ok here.
+     * Alerts are never pipelined.
      */
-    if (ctx == NULL || rec->type == SSL3_RT_ALERT) {
-        memmove(rec->data, rec->input, rec->length);
-        rec->input = rec->data;
+    if (ctx == NULL || (n_recs == 1 && rec->type == SSL3_RT_ALERT)) {
+        size_t ctr;
+
+        for (ctr = 0; ctr < n_recs; ctr++) {
+            memmove(recs[ctr].data, recs[ctr].input, recs[ctr].length);
+            recs[ctr].input = recs[ctr].data;
+        }
         return 1;
     }
 
@@ -111,83 +270,25 @@ int tls13_enc(SSL *s, SSL3_RECORD *recs, size_t n_recs, int sending,
         return 0;
     }
 
-    if (!sending) {
-        /*
-         * Take off tag. There must be at least one byte of content type as
-         * well as the tag
-         */
-        if (rec->length < taglen + 1)
-            return 0;
-        rec->length -= taglen;
-    }
-
     /* Set up IV */
     if (ivlen < SEQ_NUM_SIZE) {
         /* Should not happen */
         SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
         return 0;
     }
-    offset = ivlen - SEQ_NUM_SIZE;
-    memcpy(iv, staticiv, offset);
-    for (loop = 0; loop < SEQ_NUM_SIZE; loop++)
-        iv[offset + loop] = staticiv[offset + loop] ^ seq[loop];
 
-    /* Increment the sequence counter */
-    for (loop = SEQ_NUM_SIZE; loop > 0; loop--) {
-        ++seq[loop - 1];
-        if (seq[loop - 1] != 0)
-            break;
-    }
-    if (loop == 0) {
-        /* Sequence has wrapped */
-        return 0;
-    }
+    if (n_recs > 1)
+        return tls13_enc_parallel(s, recs, n_recs, (size_t)ivlen, taglen,
+                                  (alg_enc & SSL_AESCCM) != 0);
 
-    if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, sending) <= 0
-            || (!sending && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG,
-                                             taglen,
-                                             rec->data + rec->length) <= 0)) {
-        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+    if (!tls13_nonce(iv, staticiv, (size_t)ivlen, seq))
         return 0;
-    }
 
-    /* Set up the AAD */
-    if (!WPACKET_init_static_len(&wpkt, recheader, sizeof(recheader), 0)
-            || !WPACKET_put_bytes_u8(&wpkt, rec->type)
-            || !WPACKET_put_bytes_u16(&wpkt, rec->rec_version)
-            || !WPACKET_put_bytes_u16(&wpkt, rec->length + taglen)
-            || !WPACKET_get_total_written(&wpkt, &hdrlen)
-            || hdrlen != SSL3_RT_HEADER_LENGTH
-            || !WPACKET_finish(&wpkt)) {
+    ret = tls13_enc_rec(ctx, rec, iv, taglen, (alg_enc & SSL_AESCCM) != 0,
+                        sending);
+    if (ret < 0) {
         SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
-        WPACKET_cleanup(&wpkt);
-        return 0;
-    }
-
-    /*
-     * For CCM we must explicitly set the total plaintext length before we add
-     * any AAD.
-     */
-    if (((alg_enc & SSL_AESCCM) != 0
-                 && EVP_CipherUpdate(ctx, NULL, &lenu, NULL,
-                                     (unsigned int)rec->length) <= 0)
-            || EVP_CipherUpdate(ctx, NULL, &lenu, recheader,
-                                sizeof(recheader)) <= 0
-            || EVP_CipherUpdate(ctx, rec->data, &lenu, rec->input,
-                                (unsigned int)rec->length) <= 0
-            || EVP_CipherFinal_ex(ctx, rec->data + lenu, &lenf) <= 0
-            || (size_t)(lenu + lenf) != rec->length) {
         return 0;
     }
-    if (sending) {
-        /* Add the tag */
-        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, taglen,
-                                rec->data + rec->length) <= 0) {
-            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
-            return 0;
-        }
-        rec->length += taglen;
-    }
-
-    return 1;
+    return ret;
 }
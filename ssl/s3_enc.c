@@ -314,6 +314,10 @@ void ssl3_cleanup_key_block(SSL *s)
     OPENSSL_clear_free(s->s3.tmp.key_block, s->s3.tmp.key_block_length);
     s->s3.tmp.key_block = NULL;
     s->s3.tmp.key_block_length = 0;
+    EVP_MAC_CTX_free(s->s3.tmp.prf_mac);
+    s->s3.tmp.prf_mac = NULL;
+    OPENSSL_cleanse(s->s3.tmp.prf_mac_key, sizeof(s->s3.tmp.prf_mac_key));
+    s->s3.tmp.prf_mac_key_len = 0;
 }
 
 int ssl3_init_finished_mac(SSL *s)
@@ -4420,6 +4420,8 @@ long ssl3_ctx_ctrl(SSL_CTX *ctx, int cmd, long larg, void *parg)
                    keys + sizeof(ctx->ext.tick_key_name) +
                        sizeof(ctx->ext.secure->tick_hmac_key),
                    sizeof(ctx->ext.secure->tick_aes_key));
+            if (!tls_derive_aead_ticket_key(ctx))
+                return 0;
         }
         else
         {
@@ -4835,7 +4837,7 @@ const SSL_CIPHER *ssl3_choose_cipher(SSL *s, STACK_OF(SSL_CIPHER) * clnt,
          * TLSv1.3 spec). Therefore we should prioritise ciphersuites using
          * that.
          */
-        if (s->psk_server_callback != NULL)
+        if (s->psk_server_callback != NULL || s->ctx->psk_store != NULL)
         {
             for (j = 0; j < SSL_PKEY_NUM && !ssl_has_cert(s, j); j++)
                 ;
@@ -4886,8 +4888,9 @@ const SSL_CIPHER *ssl3_choose_cipher(SSL *s, STACK_OF(SSL_CIPHER) * clnt,
             alg_a = c->algorithm_auth;
 
 #ifndef OPENSSL_NO_PSK
-            /* with PSK there must be server callback set */
-            if ((alg_k & SSL_PSK) && s->psk_server_callback == NULL)
+            /* with PSK there must be server callback or PSK table set */
+            if ((alg_k & SSL_PSK) && s->psk_server_callback == NULL
+                    && s->ctx->psk_store == NULL)
                 continue;
 #endif /* OPENSSL_NO_PSK */
 
@@ -4942,6 +4945,15 @@ const SSL_CIPHER *ssl3_choose_cipher(SSL *s, STACK_OF(SSL_CIPHER) * clnt,
 
     sk_SSL_CIPHER_free(prio_chacha);
 
+    /*
+     * The choice is repeated for the ClientHello that follows an HRR, and
+     * when processing restarts after a session lookup
+     */
+    if (ret != NULL && s->hello_retry_request != SSL_HRR_PENDING
+            && s->sess_lookup.state == SSL_SESS_LOOKUP_NONE)
+        ssl_neg_stats_count(s, SSL_NEG_STAT_CIPHER,
+                            SSL_CIPHER_get_protocol_id(ret));
+
     return ret;
 }
 
@@ -5072,12 +5084,25 @@ int ssl3_shutdown(SSL *s)
 
 int ssl3_write(SSL *s, const void *buf, size_t len, size_t *written)
 {
+    int ret;
+
     clear_sys_error();
     if (s->s3.renegotiate)
         ssl3_renegotiate_check(s, 0);
 
-    return s->method->ssl_write_bytes(s, SSL3_RT_APPLICATION_DATA, buf, len,
-                                      written);
+    ret = s->method->ssl_write_bytes(s, SSL3_RT_APPLICATION_DATA, buf, len,
+                                     written);
+    /*
+     * The data only counts as written once a held Finished, which goes out
+     * in front of it, is flushed. Until then the write is retried, and as
+     * the data is recorded as done the retry only repeats the flush.
+     */
+    if (ret > 0 && !ssl_release_finished(s)) {
+        RECORD_LAYER_set_wnum(&s->rlayer, *written);
+        *written = 0;
+        return -1;
+    }
+    return ret;
 }
 
 static int ssl3_read_internal(SSL *s, void *buf, size_t len, int peek,
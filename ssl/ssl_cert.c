@@ -129,6 +129,12 @@ CERT *ssl_cert_dup(CERT *cert)
                 goto err;
             }
         }
+        rpk->static_flags = cpk->static_flags;
+        rpk->cert_type = cpk->cert_type;
+        rpk->key_usage = cpk->key_usage;
+        rpk->ee_sig_nid = cpk->ee_sig_nid;
+        memcpy(rpk->ca_sig_nids, cpk->ca_sig_nids, sizeof(rpk->ca_sig_nids));
+        rpk->ca_sig_nids_len = cpk->ca_sig_nids_len;
         if (cert->pkeys[i].serverinfo != NULL) {
             /* Just copy everything. */
             ret->pkeys[i].serverinfo =
@@ -227,9 +233,76 @@ void ssl_cert_clear_certs(CERT *c)
         OPENSSL_free(cpk->serverinfo);
         cpk->serverinfo = NULL;
         cpk->serverinfo_length = 0;
+        cpk->static_flags = 0;
+        cpk->cert_type = 0;
+        cpk->key_usage = 0;
+        cpk->ee_sig_nid = NID_undef;
+        cpk->ca_sig_nids_len = 0;
     }
 }
 
+/*
+ * Parameters of a certificate which are never checked against what the
+ * peer supports, because it is not an EC key.
+ */
+static int ssl_cert_param_static(X509 *x)
+{
+    EVP_PKEY *pkey = X509_get0_pubkey(x);
+
+    return pkey != NULL && !EVP_PKEY_is_a(pkey, "EC");
+}
+
+/*
+ * Recompute the parts of tls1_check_chain() and ssl_set_masks() which depend
+ * only on the certificate, key and chain of |cpk|, so that handshakes do not
+ * repeat them. Must be called whenever any of those changes.
+ */
+void ssl_cert_pkey_set_static_flags(CERT_PKEY *cpk)
+{
+    X509 *ca;
+    size_t j;
+    int i, nid;
+
+    cpk->static_flags = CERT_PKEY_STATIC_DONE;
+    cpk->cert_type = 0;
+    cpk->key_usage = 0;
+    cpk->ee_sig_nid = NID_undef;
+    if (cpk->x509 != NULL) {
+        if (ssl_cert_param_static(cpk->x509))
+            cpk->static_flags |= CERT_PKEY_STATIC_EE_PARAM;
+        cpk->key_usage = X509_get_key_usage(cpk->x509);
+        cpk->ee_sig_nid = X509_get_signature_nid(cpk->x509);
+    }
+    cpk->static_flags |= CERT_PKEY_STATIC_CA_PARAM | CERT_PKEY_STATIC_CA_SIGS;
+    cpk->ca_sig_nids_len = 0;
+    for (i = 0; i < sk_X509_num(cpk->chain); i++) {
+        ca = sk_X509_value(cpk->chain, i);
+        if (!ssl_cert_param_static(ca))
+            cpk->static_flags &= ~CERT_PKEY_STATIC_CA_PARAM;
+        if ((cpk->static_flags & CERT_PKEY_STATIC_CA_SIGS) == 0)
+            continue;
+        nid = X509_get_signature_nid(ca);
+        for (j = 0; j < cpk->ca_sig_nids_len; j++)
+            if (cpk->ca_sig_nids[j] == nid)
+                break;
+        if (j < cpk->ca_sig_nids_len)
+            continue;
+        /* Too many to remember, handshakes check the chain itself */
+        if (j == OSSL_NELEM(cpk->ca_sig_nids))
+            cpk->static_flags &= ~CERT_PKEY_STATIC_CA_SIGS;
+        else
+            cpk->ca_sig_nids[cpk->ca_sig_nids_len++] = nid;
+    }
+    if (cpk->privatekey == NULL)
+        return;
+    if (EVP_PKEY_is_a(cpk->privatekey, "RSA"))
+        cpk->cert_type = TLS_CT_RSA_SIGN;
+    else if (EVP_PKEY_is_a(cpk->privatekey, "DSA"))
+        cpk->cert_type = TLS_CT_DSS_SIGN;
+    else if (EVP_PKEY_is_a(cpk->privatekey, "EC"))
+        cpk->cert_type = TLS_CT_ECDSA_SIGN;
+}
+
 void ssl_cert_free(CERT *c)
 {
     int i;
@@ -276,6 +349,7 @@ int ssl_cert_set0_chain(SSL *s, SSL_CTX *ctx, STACK_OF(X509) *chain)
     }
     sk_X509_pop_free(cpk->chain, X509_free);
     cpk->chain = chain;
+    ssl_cert_pkey_set_static_flags(cpk);
     return 1;
 }
 
@@ -309,6 +383,7 @@ int ssl_cert_add0_chain_cert(SSL *s, SSL_CTX *ctx, X509 *x)
         cpk->chain = sk_X509_new_null();
     if (!cpk->chain || !sk_X509_push(cpk->chain, x))
         return 0;
+    ssl_cert_pkey_set_static_flags(cpk);
     return 1;
 }
 
@@ -969,6 +1044,7 @@ int ssl_build_cert_chain(SSL *s, SSL_CTX *ctx, int flags)
     }
     sk_X509_pop_free(cpk->chain, X509_free);
     cpk->chain = chain;
+    ssl_cert_pkey_set_static_flags(cpk);
     if (rv == 0)
         rv = 1;
  err:
@@ -580,6 +580,13 @@ static void clear_ciphers(SSL *s)
     ssl_clear_cipher_ctx(s);
     ssl_clear_hash_ctx(&s->read_hash);
     ssl_clear_hash_ctx(&s->write_hash);
+    ssl_tlstree_reset(&s->tlstree_read, TLSTREE_NO_CACHE_MASK);
+    ssl_tlstree_reset(&s->tlstree_write, TLSTREE_NO_CACHE_MASK);
+    ssl_key_evolution_reset(&s->key_evolution_read);
+    ssl_key_evolution_reset(&s->key_evolution_write);
+    s->mac_flags &= ~(SSL_MAC_FLAG_READ_KEY_EVOLUTION
+                      | SSL_MAC_FLAG_WRITE_KEY_EVOLUTION);
+    OPENSSL_cleanse(&s->tls13_next_keys, sizeof(s->tls13_next_keys));
 }
 
 int SSL_clear(SSL *s)
@@ -598,6 +605,8 @@ int SSL_clear(SSL *s)
     OPENSSL_free(s->psksession_id);
     s->psksession_id = NULL;
     s->psksession_id_len = 0;
+    ssl_sess_lookup_clear(s);
+    s->finished_held = 0;
     s->hello_retry_request = SSL_HRR_NONE;
     s->sent_tickets = 0;
 
@@ -666,6 +675,12 @@ int SSL_CTX_set_ssl_version(SSL_CTX *ctx, const SSL_METHOD *meth)
 {
     STACK_OF(SSL_CIPHER) *sk;
 
+#ifdef OPENSSL_BTLS_PROFILE
+    if (SSL_METHOD_IS_DTLS(meth)) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_UNSUPPORTED);
+        return 0;
+    }
+#endif
     ctx->method = meth;
 
     if (!SSL_CTX_set_ciphersuites(ctx, OSSL_default_ciphersuites())) {
@@ -685,6 +700,220 @@ int SSL_CTX_set_ssl_version(SSL_CTX *ctx, const SSL_METHOD *meth)
 }
 #endif
 
+/* Returns the shard, out of |nshards|, assigned to the calling thread */
+size_t ssl_thread_shard(size_t nshards)
+{
+    CRYPTO_THREAD_ID tid = CRYPTO_THREAD_get_current_id();
+    const unsigned char *p = (const unsigned char *)&tid;
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    /* FNV-1a, CRYPTO_THREAD_ID is opaque */
+    for (i = 0; i < sizeof(tid); i++)
+        h = (h ^ p[i]) * 16777619U;
+    return h % nshards;
+}
+
+/*
+ * Takes a reference on |ctx| through the shard assigned to the calling
+ * thread. Only the 0 to 1 transition of a shard touches |ctx->references|;
+ * the caller holds a reference on |ctx| meanwhile, as SSL_new() requires.
+ * Returns the shard, or NULL if a plain reference was taken instead.
+ */
+static SSL_CTX_REF_SHARD *ssl_ctx_shard_up_ref(SSL_CTX *ctx)
+{
+    SSL_CTX_REF_SHARD *shard;
+    int i;
+
+    shard = &ctx->ref_shards[ssl_thread_shard(SSL_CTX_REF_SHARDS)];
+
+    /* |ctx->lock| is only used where atomics are not available */
+    if (CRYPTO_UP_REF(&shard->count, &i, ctx->lock) <= 0) {
+        SSL_CTX_up_ref(ctx);
+        return NULL;
+    }
+    if (i == 1)
+        SSL_CTX_up_ref(ctx);
+    return shard;
+}
+
+/*
+ * Drops a reference taken by ssl_ctx_shard_up_ref(). When the last reference
+ * in a shard goes, the shard gives up its reference on |ctx|, which frees
+ * |ctx| if nothing else holds it.
+ */
+static void ssl_ctx_shard_free(SSL_CTX *ctx, SSL_CTX_REF_SHARD *shard)
+{
+    int i;
+
+    if (shard == NULL) {
+        SSL_CTX_free(ctx);
+        return;
+    }
+    CRYPTO_DOWN_REF(&shard->count, &i, ctx->lock);
+    REF_ASSERT_ISNT(i < 0);
+    if (i == 0)
+        SSL_CTX_free(ctx);
+}
+
+static void ssl_conn_res_free(SSL_CONN_RES *res)
+{
+    int i;
+
+    if (res == NULL)
+        return;
+    for (i = 0; i < 2; i++) {
+        OPENSSL_free(res->buf[i]);
+        EVP_CIPHER_CTX_free(res->cipher_ctx[i]);
+        EVP_MD_CTX_free(res->md_ctx[i]);
+    }
+    BUF_MEM_free(res->init_buf);
+    OPENSSL_free(res);
+}
+
+/* Takes an entry from the pool of |ctx|, or returns NULL if it is empty */
+static SSL_CONN_RES *ssl_conn_res_pop(SSL_CTX *ctx)
+{
+    SSL_CONN_RES *res;
+
+    if (ctx->conn_pool_max == 0
+            || !CRYPTO_THREAD_write_lock(ctx->conn_pool_lock))
+        return NULL;
+    res = ctx->conn_pool;
+    if (res != NULL) {
+        ctx->conn_pool = res->next;
+        ctx->conn_pool_len--;
+        res->next = NULL;
+    }
+    CRYPTO_THREAD_unlock(ctx->conn_pool_lock);
+    return res;
+}
+
+/*
+ * Moves the reusable allocations of |s|, which is being freed, to the pool
+ * of its SSL_CTX. The SSL_free() code which follows finds them gone.
+ */
+static void ssl_conn_res_push(SSL *s)
+{
+    SSL_CONN_RES *res = s->conn_res;
+    SSL_CTX *ctx = s->ctx;
+    SSL3_BUFFER *rb = RECORD_LAYER_get_rbuf(&s->rlayer);
+    SSL3_BUFFER *wb = RECORD_LAYER_get_wbuf(&s->rlayer);
+    EVP_CIPHER_CTX **cctx[2];
+    EVP_MD_CTX **mctx[2];
+    int i;
+
+    s->conn_res = NULL;
+    /* DTLS may keep the write contexts in its retransmission queue */
+    if (ctx == NULL || ctx->conn_pool_max == 0 || s->method == NULL
+            || SSL_IS_DTLS(s)) {
+        ssl_conn_res_free(res);
+        return;
+    }
+    if (res == NULL && (res = OPENSSL_zalloc(sizeof(*res))) == NULL)
+        return;
+
+    if (res->buf[0] == NULL && rb->buf != NULL) {
+        if (s->options & SSL_OP_CLEANSE_PLAINTEXT)
+            OPENSSL_cleanse(rb->buf, rb->len);
+        res->buf[0] = rb->buf;
+        res->buf_len[0] = rb->len;
+        rb->buf = NULL;
+    }
+    if (res->buf[1] == NULL && s->rlayer.numwpipes > 0 && wb->buf != NULL
+            && !SSL3_BUFFER_is_app_buffer(wb)) {
+        res->buf[1] = wb->buf;
+        res->buf_len[1] = wb->len;
+        wb->buf = NULL;
+    }
+    if (res->init_buf == NULL) {
+        res->init_buf = s->init_buf;
+        s->init_buf = NULL;
+    }
+
+    cctx[0] = &s->enc_read_ctx;
+    cctx[1] = &s->enc_write_ctx;
+    mctx[0] = &s->read_hash;
+    mctx[1] = &s->write_hash;
+    for (i = 0; i < 2; i++) {
+        if (res->cipher_ctx[i] == NULL && *cctx[i] != NULL) {
+            EVP_CIPHER_CTX_reset(*cctx[i]);
+            res->cipher_ctx[i] = *cctx[i];
+            *cctx[i] = NULL;
+        }
+        if (res->md_ctx[i] == NULL && *mctx[i] != NULL) {
+            EVP_MD_CTX_reset(*mctx[i]);
+            res->md_ctx[i] = *mctx[i];
+            *mctx[i] = NULL;
+        }
+    }
+
+    if (!CRYPTO_THREAD_write_lock(ctx->conn_pool_lock)) {
+        ssl_conn_res_free(res);
+        return;
+    }
+    if (ctx->conn_pool_len < ctx->conn_pool_max) {
+        res->next = ctx->conn_pool;
+        ctx->conn_pool = res;
+        ctx->conn_pool_len++;
+        res = NULL;
+    }
+    CRYPTO_THREAD_unlock(ctx->conn_pool_lock);
+    ssl_conn_res_free(res);
+}
+
+/*
+ * Returns a pooled record buffer of at least |len| bytes for the given
+ * direction, or NULL if there is none.
+ */
+unsigned char *ssl_conn_res_take_buf(SSL *s, int sending, size_t len)
+{
+    SSL_CONN_RES *res = s->conn_res;
+    unsigned char *buf;
+
+    if (res == NULL || res->buf[sending] == NULL
+            || res->buf_len[sending] < len)
+        return NULL;
+    buf = res->buf[sending];
+    res->buf[sending] = NULL;
+    return buf;
+}
+
+BUF_MEM *ssl_conn_res_take_init_buf(SSL *s)
+{
+    BUF_MEM *buf;
+
+    if (s->conn_res == NULL)
+        return NULL;
+    buf = s->conn_res->init_buf;
+    s->conn_res->init_buf = NULL;
+    return buf;
+}
+
+/* Returns a pooled cipher context, or a new one if there is none */
+EVP_CIPHER_CTX *ssl_conn_res_take_cipher_ctx(SSL *s, int sending)
+{
+    EVP_CIPHER_CTX *ctx;
+
+    if (s->conn_res == NULL || s->conn_res->cipher_ctx[sending] == NULL)
+        return EVP_CIPHER_CTX_new();
+    ctx = s->conn_res->cipher_ctx[sending];
+    s->conn_res->cipher_ctx[sending] = NULL;
+    return ctx;
+}
+
+/* Returns a pooled digest context, or NULL if there is none */
+EVP_MD_CTX *ssl_conn_res_take_md_ctx(SSL *s, int sending)
+{
+    EVP_MD_CTX *ctx;
+
+    if (s->conn_res == NULL)
+        return NULL;
+    ctx = s->conn_res->md_ctx[sending];
+    s->conn_res->md_ctx[sending] = NULL;
+    return ctx;
+}
+
 SSL *SSL_new(SSL_CTX *ctx)
 {
     SSL *s;
@@ -722,6 +951,7 @@ SSL *SSL_new(SSL_CTX *ctx)
     s->recv_max_early_data = ctx->recv_max_early_data;
     s->num_tickets = ctx->num_tickets;
     s->pha_enabled = ctx->pha_enabled;
+    s->key_evolution_bits = ctx->key_evolution_bits;
 
     /* Shallow copy of the ciphersuites stack */
     s->tls13_ciphersuites = sk_SSL_CIPHER_dup(ctx->tls13_ciphersuites);
@@ -771,7 +1001,7 @@ SSL *SSL_new(SSL_CTX *ctx)
     if (ctx->default_read_buf_len > 0)
         SSL_set_default_read_buffer_len(s, ctx->default_read_buf_len);
 
-    SSL_CTX_up_ref(ctx);
+    s->ctx_ref = ssl_ctx_shard_up_ref(ctx);
     s->ctx = ctx;
     s->ext.debug_cb = 0;
     s->ext.debug_arg = NULL;
@@ -782,7 +1012,7 @@ SSL *SSL_new(SSL_CTX *ctx)
     s->ext.ocsp.exts = NULL;
     s->ext.ocsp.resp = NULL;
     s->ext.ocsp.resp_len = 0;
-    SSL_CTX_up_ref(ctx);
+    s->session_ctx_ref = ssl_ctx_shard_up_ref(ctx);
     s->session_ctx = ctx;
     if (ctx->ext.ecpointformats) {
         s->ext.ecpointformats =
@@ -828,6 +1058,8 @@ SSL *SSL_new(SSL_CTX *ctx)
     s->default_passwd_callback_userdata = ctx->default_passwd_callback_userdata;
 
     s->method = ctx->method;
+    if (!SSL_IS_DTLS(s))
+        s->conn_res = ssl_conn_res_pop(ctx);
 
     s->key_update = SSL_KEY_UPDATE_NONE;
 
@@ -1201,6 +1433,7 @@ void SSL_free(SSL *s)
     dane_final(&s->dane);
     CRYPTO_free_ex_data(CRYPTO_EX_INDEX_SSL, s, &s->ex_data);
 
+    ssl_conn_res_push(s);
     RECORD_LAYER_release(&s->rlayer);
 
     /* Ignore return value */
@@ -1226,13 +1459,14 @@ void SSL_free(SSL *s)
     }
     SSL_SESSION_free(s->psksession);
     OPENSSL_free(s->psksession_id);
+    ssl_sess_lookup_clear(s);
 
     ssl_cert_free(s->cert);
     OPENSSL_free(s->shared_sigalgs);
     /* Free up if allocated */
 
     OPENSSL_free(s->ext.hostname);
-    SSL_CTX_free(s->session_ctx);
+    ssl_ctx_shard_free(s->session_ctx, s->session_ctx_ref);
     OPENSSL_free(s->ext.ecpointformats);
     OPENSSL_free(s->ext.peer_ecpointformats);
     OPENSSL_free(s->ext.supportedgroups);
@@ -1246,6 +1480,7 @@ void SSL_free(SSL *s)
     OPENSSL_free(s->ext.scts);
 #endif
     OPENSSL_free(s->ext.ocsp.resp);
+    ssl_ocsp_staple_free(s->ext.ocsp.staple);
     OPENSSL_free(s->ext.alpn);
     OPENSSL_free(s->ext.tls13_cookie);
     if (s->clienthello != NULL)
@@ -1267,8 +1502,9 @@ void SSL_free(SSL *s)
      * may reference the EVP_CIPHER_CTX/EVP_MD_CTX that are freed here.
      */
     clear_ciphers(s);
+    EVP_KDF_CTX_free(s->tls13_kdf);
 
-    SSL_CTX_free(s->ctx);
+    ssl_ctx_shard_free(s->ctx, s->ctx_ref);
 
     ASYNC_WAIT_CTX_free(s->waitctx);
 
@@ -2042,6 +2278,88 @@ int SSL_peek_ex(SSL *s, void *buf, size_t num, size_t *readbytes)
     return ret;
 }
 
+/*
+ * Zero-copy read: on success |*data| points at the unread part of the
+ * current decrypted application data record and |*len| is its length. The
+ * data stays valid until SSL_read_release() consumes it or any other read
+ * call is made on |s|. Each call returns data from a single record only, so a
+ * call made after the previous record was fully released starts at a record
+ * boundary. Returns 1 on success and 0 on failure, like SSL_read_ex().
+ */
+int SSL_read_borrow(SSL *s, const unsigned char **data, size_t *len)
+{
+    size_t readbytes;
+    int ret;
+
+    if (SSL_IS_DTLS(s)) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_SHOULD_NOT_HAVE_BEEN_CALLED);
+        return 0;
+    }
+
+    while (!ssl3_read_borrow(s, data, len)) {
+        /*
+         * A zero length peek processes records until application data is
+         * available, without copying anything out. It returns 0 when it
+         * finds data, and also for empty records, which we skip. Any other
+         * return, including a 0 for which no record was read, is final.
+         */
+        ret = ssl_peek_internal(s, NULL, 0, &readbytes);
+        if (ret != 0 || (s->shutdown & SSL_RECEIVED_SHUTDOWN)
+                || !ssl3_read_has_record(s))
+            return 0;
+    }
+    return 1;
+}
+
+/* Consumes |len| bytes of the data returned by SSL_read_borrow() */
+int SSL_read_release(SSL *s, size_t len)
+{
+    if (SSL_IS_DTLS(s)) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_SHOULD_NOT_HAVE_BEEN_CALLED);
+        return 0;
+    }
+    if (!ssl3_read_release(s, len)) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_PASSED_INVALID_ARGUMENT);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Forwards application data received on |in| to |out|, as a re-encrypting
+ * proxy does. The data is borrowed from the read buffer of |in|, where it was
+ * decrypted in place, and is copied straight into the write buffer of |out|
+ * to be encrypted there, with no application buffer in between. Each call
+ * forwards at most |max| bytes from a single record of |in|, so that record
+ * boundaries are kept if |out| can send records as large as those of |in|.
+ *
+ * Returns 1 and sets |*forwarded| on success. Returns 0 on failure, and
+ * SSL_get_error() on |in| or |out| tells which side must be waited for. Data
+ * that was not forwarded stays in |in|, so the call can simply be repeated,
+ * with the same |max|, as SSL_write() retries require.
+ */
+int SSL_forward(SSL *in, SSL *out, size_t max, size_t *forwarded)
+{
+    const unsigned char *data;
+    size_t len;
+
+    *forwarded = 0;
+    if (max == 0)
+        return 1;
+    if (!SSL_read_borrow(in, &data, &len))
+        return 0;
+    if (len > max)
+        len = max;
+    if (!SSL_write_ex(out, data, len, forwarded))
+        return 0;
+    if (!SSL_read_release(in, *forwarded)) {
+        /* Should not happen */
+        ERR_raise(ERR_LIB_SSL, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+    return 1;
+}
+
 int ssl_write_internal(SSL *s, const void *buf, size_t num, size_t *written)
 {
     if (s->handshake_func == NULL) {
@@ -3227,6 +3545,13 @@ SSL_CTX *SSL_CTX_new_ex(OSSL_LIB_CTX *libctx, const char *propq,
         ERR_raise(ERR_LIB_SSL, SSL_R_NULL_SSL_METHOD_PASSED);
         return NULL;
     }
+#ifdef OPENSSL_BTLS_PROFILE
+    /* The BTLS profile only builds TLS, see ssl_local.h */
+    if (SSL_METHOD_IS_DTLS(meth)) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_UNSUPPORTED);
+        return NULL;
+    }
+#endif
 
     if (!OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS, NULL))
         return NULL;
@@ -3248,6 +3573,17 @@ SSL_CTX *SSL_CTX_new_ex(OSSL_LIB_CTX *libctx, const char *propq,
         return NULL;
     }
 
+    ret->conn_pool_lock = CRYPTO_THREAD_lock_new();
+    ret->psk_store_lock = CRYPTO_THREAD_lock_new();
+    ret->ext.ocsp_cache_lock = CRYPTO_THREAD_lock_new();
+    ret->presign_lock = CRYPTO_THREAD_lock_new();
+    if (ret->conn_pool_lock == NULL || ret->psk_store_lock == NULL
+            || ret->ext.ocsp_cache_lock == NULL
+            || ret->presign_lock == NULL) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+
 #ifdef TSAN_REQUIRES_LOCKING
     ret->tsan_lock = CRYPTO_THREAD_lock_new();
     if (ret->tsan_lock == NULL) {
@@ -3283,6 +3619,11 @@ SSL_CTX *SSL_CTX_new_ex(OSSL_LIB_CTX *libctx, const char *propq,
     if (ret->cert_store == NULL)
         goto err;
 #ifndef OPENSSL_NO_CT
+    ret->ct_cache_lock = CRYPTO_THREAD_lock_new();
+    if (ret->ct_cache_lock == NULL) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
     ret->ctlog_store = CTLOG_STORE_new_ex(libctx, propq);
     if (ret->ctlog_store == NULL)
         goto err;
@@ -3347,7 +3688,8 @@ SSL_CTX *SSL_CTX_new_ex(OSSL_LIB_CTX *libctx, const char *propq,
         || (RAND_priv_bytes_ex(libctx, ret->ext.secure->tick_hmac_key,
                                sizeof(ret->ext.secure->tick_hmac_key), 0) <= 0)
         || (RAND_priv_bytes_ex(libctx, ret->ext.secure->tick_aes_key,
-                               sizeof(ret->ext.secure->tick_aes_key), 0) <= 0))
+                               sizeof(ret->ext.secure->tick_aes_key), 0) <= 0)
+        || !tls_derive_aead_ticket_key(ret))
         ret->options |= SSL_OP_NO_TICKET;
 
     if (RAND_priv_bytes_ex(libctx, ret->ext.cookie_hmac_key,
@@ -3480,6 +3822,8 @@ void SSL_CTX_free(SSL_CTX *a)
     X509_STORE_free(a->cert_store);
 #ifndef OPENSSL_NO_CT
     CTLOG_STORE_free(a->ctlog_store);
+    OPENSSL_free(a->ct_cache);
+    CRYPTO_THREAD_lock_free(a->ct_cache_lock);
 #endif
     sk_SSL_CIPHER_free(a->cipher_list);
     sk_SSL_CIPHER_free(a->cipher_list_by_id);
@@ -3504,6 +3848,7 @@ void SSL_CTX_free(SSL_CTX *a)
     OPENSSL_free(a->ext.supported_groups_default);
     OPENSSL_free(a->ext.alpn);
     OPENSSL_secure_free(a->ext.secure);
+    EVP_CIPHER_free(a->ext.tick_aead);
 
     ssl_evp_md_free(a->md5);
     ssl_evp_md_free(a->sha1);
@@ -3521,6 +3866,19 @@ void SSL_CTX_free(SSL_CTX *a)
 
     OPENSSL_free(a->sigalg_lookup_cache);
 
+    while (a->conn_pool != NULL) {
+        SSL_CONN_RES *res = a->conn_pool;
+
+        a->conn_pool = res->next;
+        ssl_conn_res_free(res);
+    }
+    CRYPTO_THREAD_lock_free(a->conn_pool_lock);
+    SSL_PSK_STORE_free(a->psk_store);
+    CRYPTO_THREAD_lock_free(a->psk_store_lock);
+    ssl_ocsp_cache_free(a);
+    ssl_peer_pool_ctx_free(a);
+    ssl_neg_stats_ctx_free(a);
+    ssl_presign_pool_free(a);
     CRYPTO_THREAD_lock_free(a->lock);
 #ifdef TSAN_REQUIRES_LOCKING
     CRYPTO_THREAD_lock_free(a->tsan_lock);
@@ -3674,7 +4032,10 @@ void ssl_set_masks(SSL *s)
      */
     if (have_ecc_cert) {
         uint32_t ex_kusage;
-        ex_kusage = X509_get_key_usage(c->pkeys[SSL_PKEY_ECC].x509);
+        if ((c->pkeys[SSL_PKEY_ECC].static_flags & CERT_PKEY_STATIC_DONE) != 0)
+            ex_kusage = c->pkeys[SSL_PKEY_ECC].key_usage;
+        else
+            ex_kusage = X509_get_key_usage(c->pkeys[SSL_PKEY_ECC].x509);
         ecdsa_ok = ex_kusage & X509v3_KU_DIGITAL_SIGNATURE;
         if (!(pvalid[SSL_PKEY_ECC] & CERT_PKEY_SIGN))
             ecdsa_ok = 0;
@@ -3826,6 +4187,12 @@ int SSL_set_ssl_method(SSL *s, const SSL_METHOD *meth)
 {
     int ret = 1;
 
+#ifdef OPENSSL_BTLS_PROFILE
+    if (SSL_METHOD_IS_DTLS(meth)) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_UNSUPPORTED);
+        return 0;
+    }
+#endif
     if (s->method != meth) {
         const SSL_METHOD *sm = s->method;
         int (*hf) (SSL *) = s->handshake_func;
@@ -3922,6 +4289,8 @@ int SSL_get_error(const SSL *s, int i)
         return SSL_ERROR_WANT_ASYNC_JOB;
     if (SSL_want_client_hello_cb(s))
         return SSL_ERROR_WANT_CLIENT_HELLO_CB;
+    if (SSL_want_session_lookup(s))
+        return SSL_ERROR_WANT_SESSION_LOOKUP;
 
     if ((s->shutdown & SSL_RECEIVED_SHUTDOWN) &&
         (s->s3.warn_alert == SSL_AD_CLOSE_NOTIFY))
@@ -4184,6 +4553,8 @@ SSL *SSL_dup(SSL *s)
 
 void ssl_clear_cipher_ctx(SSL *s)
 {
+    size_t i;
+
     if (s->enc_read_ctx != NULL) {
         EVP_CIPHER_CTX_free(s->enc_read_ctx);
         s->enc_read_ctx = NULL;
@@ -4192,6 +4563,10 @@ void ssl_clear_cipher_ctx(SSL *s)
         EVP_CIPHER_CTX_free(s->enc_write_ctx);
         s->enc_write_ctx = NULL;
     }
+    for (i = 0; i < SSL_MAX_PIPELINES; i++) {
+        EVP_CIPHER_CTX_free(s->enc_write_pipe_ctx[i]);
+        s->enc_write_pipe_ctx[i] = NULL;
+    }
 #ifndef OPENSSL_NO_COMP
     COMP_CTX_free(s->expand);
     s->expand = NULL;
@@ -4296,6 +4671,111 @@ int ssl_free_wbio_buffer(SSL *s)
     return 1;
 }
 
+/*
+ * Coalescing of the TLSv1.3 client Finished with the first application data.
+ * Instead of flushing its last flight, the client leaves it in the buffering
+ * BIO, which stays pushed after the handshake. The first application record
+ * is written behind it and both leave in a single write to the transport.
+ * Reading, which may wait for the peer, and the timeout release it as well.
+ */
+
+void SSL_CTX_set_finished_coalescing(SSL_CTX *ctx, unsigned int timeout_ms)
+{
+    ctx->finished_coalesce_ms = timeout_ms;
+}
+
+/*
+ * Holds back the Finished that the client just wrote, if coalescing applies.
+ * Returns 1 if it is held, or 0 if it must be flushed now.
+ */
+int ssl_hold_finished(SSL *s)
+{
+    if (s->ctx->finished_coalesce_ms == 0 || s->server || !SSL_IS_TLS13(s)
+            || SSL_IS_DTLS(s) || s->bbio == NULL
+            || s->post_handshake_auth == SSL_PHA_REQUESTED
+            || (s->options & SSL_OP_ENABLE_KTLS) != 0)
+        return 0;
+    s->finished_held = 1;
+    ssl_get_current_time(&s->finished_held_at);
+    return 1;
+}
+
+/*
+ * Sends a held Finished, with whatever was written behind it, and drops the
+ * buffering BIO. Returns 1 on success, or 0 if the flush must be retried.
+ */
+int ssl_release_finished(SSL *s)
+{
+    if (!s->finished_held)
+        return 1;
+    if (statem_flush(s) != 1)
+        return 0;
+    s->finished_held = 0;
+    return ssl_free_wbio_buffer(s);
+}
+
+/*
+ * Gets the time left before a held Finished must be sent in |*timeleft|.
+ * Returns 1 if a Finished is held, or 0 otherwise.
+ */
+int SSL_get_coalescing_timeout(SSL *s, struct timeval *timeleft)
+{
+    struct timeval now;
+    long long left;
+
+    if (!s->finished_held)
+        return 0;
+    ssl_get_current_time(&now);
+    left = (long long)s->ctx->finished_coalesce_ms * 1000
+        - ((long long)(now.tv_sec - s->finished_held_at.tv_sec) * 1000000
+           + (now.tv_usec - s->finished_held_at.tv_usec));
+    if (left < 0)
+        left = 0;
+    timeleft->tv_sec = (long)(left / 1000000);
+    timeleft->tv_usec = (long)(left % 1000000);
+    return 1;
+}
+
+/*
+ * Sends a held Finished if its timeout has passed. Returns 1 if it was sent,
+ * 0 if there was nothing to send yet, or -1 if the flush must be retried.
+ */
+int SSL_handle_coalescing_timeout(SSL *s)
+{
+    struct timeval left;
+
+    if (!SSL_get_coalescing_timeout(s, &left)
+            || left.tv_sec != 0 || left.tv_usec != 0)
+        return 0;
+    return ssl_release_finished(s) ? 1 : -1;
+}
+
+void ssl_get_current_time(struct timeval *t)
+{
+#if defined(_WIN32)
+    SYSTEMTIME st;
+    union {
+        unsigned __int64 ul;
+        FILETIME ft;
+    } now;
+
+    GetSystemTime(&st);
+    SystemTimeToFileTime(&st, &now.ft);
+    /* re-bias to 1/1/1970 */
+# ifdef  __MINGW32__
+    now.ul -= 116444736000000000ULL;
+# else
+    /* *INDENT-OFF* */
+    now.ul -= 116444736000000000UI64;
+    /* *INDENT-ON* */
+# endif
+    t->tv_sec = (long)(now.ul / 10000000);
+    t->tv_usec = ((int)(now.ul % 10000000)) / 10;
+#else
+    gettimeofday(t, NULL);
+#endif
+}
+
 void SSL_CTX_set_quiet_shutdown(SSL_CTX *ctx, int mode)
 {
     ctx->quiet_shutdown = mode;
@@ -4382,7 +4862,9 @@ SSL_CTX *SSL_set_SSL_CTX(SSL *ssl, SSL_CTX *ctx)
     }
 
     SSL_CTX_up_ref(ctx);
-    SSL_CTX_free(ssl->ctx);     /* decrement reference count */
+    /* decrement reference count */
+    ssl_ctx_shard_free(ssl->ctx, ssl->ctx_ref);
+    ssl->ctx_ref = NULL;
     ssl->ctx = ctx;
 
     return ssl->ctx;
@@ -4745,6 +5227,84 @@ int SSL_CTX_set_block_padding(SSL_CTX *ctx, size_t block_size)
     return 1;
 }
 
+/*
+ * Key evolution for the BELT ciphersuites: the record keys are rederived every
+ * 2^|bits| records. Both peers must use the same setting. 0 disables it.
+ */
+int SSL_CTX_set_key_evolution_bits(SSL_CTX *ctx, unsigned int bits)
+{
+    if (bits > SSL_KEY_EVOLUTION_MAX_BITS)
+        return 0;
+    ctx->key_evolution_bits = bits;
+    return 1;
+}
+
+unsigned int SSL_CTX_get_key_evolution_bits(const SSL_CTX *ctx)
+{
+    return ctx->key_evolution_bits;
+}
+
+int SSL_set_key_evolution_bits(SSL *s, unsigned int bits)
+{
+    if (bits > SSL_KEY_EVOLUTION_MAX_BITS)
+        return 0;
+    s->key_evolution_bits = bits;
+    return 1;
+}
+
+unsigned int SSL_get_key_evolution_bits(const SSL *s)
+{
+    return s->key_evolution_bits;
+}
+
+/*
+ * Keep the record buffers, handshake buffer and cipher and MAC contexts of up
+ * to |size| freed TLS connections, for reuse by new SSL objects created from
+ * |ctx|. 0, the default, disables the pool.
+ */
+int SSL_CTX_set_conn_pool_size(SSL_CTX *ctx, size_t size)
+{
+    SSL_CONN_RES *res, *excess = NULL;
+
+    if (!CRYPTO_THREAD_write_lock(ctx->conn_pool_lock))
+        return 0;
+    ctx->conn_pool_max = size;
+    while (ctx->conn_pool_len > size) {
+        res = ctx->conn_pool;
+        ctx->conn_pool = res->next;
+        ctx->conn_pool_len--;
+        res->next = excess;
+        excess = res;
+    }
+    CRYPTO_THREAD_unlock(ctx->conn_pool_lock);
+
+    while (excess != NULL) {
+        res = excess;
+        excess = res->next;
+        ssl_conn_res_free(res);
+    }
+    return 1;
+}
+
+size_t SSL_CTX_get_conn_pool_size(const SSL_CTX *ctx)
+{
+    return ctx->conn_pool_max;
+}
+
+/*
+ * Sets the executor used to encrypt the records of a TLSv1.3 write in
+ * parallel. With one set, writes are split into up to max_pipelines records,
+ * see SSL_CTX_set_max_pipelines(), and each record is encrypted as a separate
+ * job. NULL restores serial encryption.
+ */
+void SSL_CTX_set_record_parallel_cb(SSL_CTX *ctx,
+                                    SSL_record_parallel_cb_func cb,
+                                    void *arg)
+{
+    ctx->record_parallel_cb = cb;
+    ctx->record_parallel_arg = arg;
+}
+
 int SSL_set_record_padding_callback(SSL *ssl,
                                      size_t (*cb) (SSL *ssl, int type,
                                                    size_t len, void *arg))
@@ -4814,8 +5374,11 @@ size_t SSL_CTX_get_num_tickets(const SSL_CTX *ctx)
 
 EVP_MD_CTX *ssl_replace_hash(EVP_MD_CTX **hash, const EVP_MD *md)
 {
-    ssl_clear_hash_ctx(hash);
-    *hash = EVP_MD_CTX_new();
+    /* Reuse the existing allocation, nothing else refers to it */
+    if (*hash != NULL)
+        EVP_MD_CTX_reset(*hash);
+    else
+        *hash = EVP_MD_CTX_new();
     if (*hash == NULL || (md && EVP_DigestInit_ex(*hash, md, NULL) <= 0)) {
         EVP_MD_CTX_free(*hash);
         *hash = NULL;
@@ -5230,6 +5793,75 @@ int SSL_CTX_ct_is_enabled(const SSL_CTX *ctx)
     return ctx->ct_validation_callback != NULL;
 }
 
+/*
+ * Computes the key of the SCT validation cache for |scts| sent with |cert|,
+ * issued by |issuer|. Returns 0 if that is not possible.
+ */
+static int ct_cache_key(SSL *s, X509 *cert, X509 *issuer,
+                        const STACK_OF(SCT) *scts,
+                        unsigned char key[SHA256_DIGEST_LENGTH])
+{
+    unsigned char certmd[SHA256_DIGEST_LENGTH], issuermd[SHA256_DIGEST_LENGTH];
+    unsigned char *sctlist = NULL;
+    unsigned int mdlen;
+    const EVP_MD *md;
+    EVP_MD_CTX *mctx = NULL;
+    int sctlistlen, ret = 0;
+
+    md = ssl_evp_md_fetch(s->ctx->libctx, NID_sha256, s->ctx->propq);
+    if (md == NULL)
+        return 0;
+    sctlistlen = i2o_SCT_LIST(scts, &sctlist);
+    if (sctlistlen <= 0
+            || !X509_digest(cert, md, certmd, &mdlen)
+            || !X509_digest(issuer, md, issuermd, &mdlen)
+            || (mctx = EVP_MD_CTX_new()) == NULL
+            || !EVP_DigestInit_ex(mctx, md, NULL)
+            || !EVP_DigestUpdate(mctx, certmd, sizeof(certmd))
+            || !EVP_DigestUpdate(mctx, issuermd, sizeof(issuermd))
+            || !EVP_DigestUpdate(mctx, sctlist, sctlistlen)
+            || !EVP_DigestUpdate(mctx, &s->ctx->ctlog_store_gen,
+                                 sizeof(s->ctx->ctlog_store_gen))
+            || !EVP_DigestFinal_ex(mctx, key, NULL))
+        goto end;
+    ret = 1;
+ end:
+    EVP_MD_CTX_free(mctx);
+    OPENSSL_free(sctlist);
+    ssl_evp_md_free(md);
+    return ret;
+}
+
+static unsigned char *ct_cache_slot(SSL_CTX *ctx, const unsigned char *key)
+{
+    size_t idx = ((size_t)key[0] << 24 | (size_t)key[1] << 16
+                  | (size_t)key[2] << 8 | key[3]) % ctx->ct_cache_size;
+
+    return ctx->ct_cache[idx];
+}
+
+static int ct_cache_lookup(SSL_CTX *ctx, const unsigned char *key)
+{
+    int found = 0;
+
+    if (!CRYPTO_THREAD_read_lock(ctx->ct_cache_lock))
+        return 0;
+    if (ctx->ct_cache_size > 0)
+        found = CRYPTO_memcmp(ct_cache_slot(ctx, key), key,
+                              SHA256_DIGEST_LENGTH) == 0;
+    CRYPTO_THREAD_unlock(ctx->ct_cache_lock);
+    return found;
+}
+
+static void ct_cache_add(SSL_CTX *ctx, const unsigned char *key)
+{
+    if (!CRYPTO_THREAD_write_lock(ctx->ct_cache_lock))
+        return;
+    if (ctx->ct_cache_size > 0)
+        memcpy(ct_cache_slot(ctx, key), key, SHA256_DIGEST_LENGTH);
+    CRYPTO_THREAD_unlock(ctx->ct_cache_lock);
+}
+
 int ssl_validate_ct(SSL *s)
 {
     int ret = 0;
@@ -5238,6 +5870,8 @@ int ssl_validate_ct(SSL *s)
     SSL_DANE *dane = &s->dane;
     CT_POLICY_EVAL_CTX *ctx = NULL;
     const STACK_OF(SCT) *scts;
+    unsigned char cache_key[SHA256_DIGEST_LENGTH];
+    int cacheable;
 
     /*
      * If no callback is set, the peer is anonymous, or its chain is invalid,
@@ -5267,21 +5901,33 @@ int ssl_validate_ct(SSL *s)
         }
     }
 
+    issuer = sk_X509_value(s->verified_chain, 1);
+    scts = SSL_get0_peer_scts(s);
+
+    /*
+     * The outcome of the strict policy only depends on the cache key, except
+     * that SCTs with a future timestamp may become valid later, so only
+     * successes are cached. Other callbacks may look at anything, so they
+     * always get freshly validated SCTs.
+     */
+    cacheable = s->ct_validation_callback == ct_strict
+                && s->ctx->ct_cache_size > 0
+                && ct_cache_key(s, cert, issuer, scts, cache_key);
+    if (cacheable && ct_cache_lookup(s->ctx, cache_key))
+        return 1;
+
     ctx = CT_POLICY_EVAL_CTX_new_ex(s->ctx->libctx, s->ctx->propq);
     if (ctx == NULL) {
         SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_MALLOC_FAILURE);
         goto end;
     }
 
-    issuer = sk_X509_value(s->verified_chain, 1);
     CT_POLICY_EVAL_CTX_set1_cert(ctx, cert);
     CT_POLICY_EVAL_CTX_set1_issuer(ctx, issuer);
     CT_POLICY_EVAL_CTX_set_shared_CTLOG_STORE(ctx, s->ctx->ctlog_store);
     CT_POLICY_EVAL_CTX_set_time(
             ctx, (uint64_t)SSL_SESSION_get_time(SSL_get0_session(s)) * 1000);
 
-    scts = SSL_get0_peer_scts(s);
-
     /*
      * This function returns success (> 0) only when all the SCTs are valid, 0
      * when some are invalid, and < 0 on various internal errors (out of
@@ -5306,6 +5952,8 @@ int ssl_validate_ct(SSL *s)
         ret = 0;                /* This function returns 0 on failure */
     if (!ret)
         SSLfatal(s, SSL_AD_HANDSHAKE_FAILURE, SSL_R_CALLBACK_FAILED);
+    else if (cacheable)
+        ct_cache_add(s->ctx, cache_key);
 
  end:
     CT_POLICY_EVAL_CTX_free(ctx);
@@ -5357,11 +6005,13 @@ int SSL_enable_ct(SSL *s, int validation_mode)
 
 int SSL_CTX_set_default_ctlog_list_file(SSL_CTX *ctx)
 {
+    ctx->ctlog_store_gen++;
     return CTLOG_STORE_load_default_file(ctx->ctlog_store);
 }
 
 int SSL_CTX_set_ctlog_list_file(SSL_CTX *ctx, const char *path)
 {
+    ctx->ctlog_store_gen++;
     return CTLOG_STORE_load_file(ctx->ctlog_store, path);
 }
 
@@ -5369,6 +6019,37 @@ void SSL_CTX_set0_ctlog_store(SSL_CTX *ctx, CTLOG_STORE * logs)
 {
     CTLOG_STORE_free(ctx->ctlog_store);
     ctx->ctlog_store = logs;
+    ctx->ctlog_store_gen++;
+}
+
+/*
+ * Remember up to |size| successful strict SCT validations, so that repeat
+ * connections to the same server skip the SCT signature checks. The SCTs of
+ * such connections are left without a validation status. 0, the default,
+ * disables the cache.
+ */
+int SSL_CTX_set_ct_cache_size(SSL_CTX *ctx, size_t size)
+{
+    unsigned char (*cache)[SHA256_DIGEST_LENGTH] = NULL;
+
+    if (size > 0 && (cache = OPENSSL_zalloc(size * sizeof(*cache))) == NULL) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    if (!CRYPTO_THREAD_write_lock(ctx->ct_cache_lock)) {
+        OPENSSL_free(cache);
+        return 0;
+    }
+    OPENSSL_free(ctx->ct_cache);
+    ctx->ct_cache = cache;
+    ctx->ct_cache_size = size;
+    CRYPTO_THREAD_unlock(ctx->ct_cache_lock);
+    return 1;
+}
+
+size_t SSL_CTX_get_ct_cache_size(const SSL_CTX *ctx)
+{
+    return ctx->ct_cache_size;
 }
 
 const CTLOG_STORE *SSL_CTX_get0_ctlog_store(const SSL_CTX *ctx)
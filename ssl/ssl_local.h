@@ -37,6 +37,26 @@
 # include "internal/ktls.h"
 #include "btls.h"
 
+/*-
+ * Build profile for deployments that only use the TLSv1.2 BTLS suites and
+ * TLSv1.3, enabled with
+ *
+ *   ./Configure no-ssl3 no-dtls no-srp no-comp no-nextprotoneg no-gost \
+ *       -DOPENSSL_BTLS_PROFILE
+ *
+ * The no- options compile out most of what is not needed. The profile
+ * compiles out the rest, which has no option of its own: DTLS methods are
+ * refused, so that SSL_IS_DTLS() is constant and the DTLS branches go from
+ * the TLS code paths, and SSLv2 compatible ClientHellos are not accepted.
+ */
+# ifdef OPENSSL_BTLS_PROFILE
+#  if !defined(OPENSSL_NO_SSL3) || !defined(OPENSSL_NO_DTLS) \
+      || !defined(OPENSSL_NO_SRP) || !defined(OPENSSL_NO_COMP) \
+      || !defined(OPENSSL_NO_NEXTPROTONEG) || !defined(OPENSSL_NO_GOST)
+#   error "OPENSSL_BTLS_PROFILE requires the Configure options listed above"
+#  endif
+# endif
+
 # ifdef OPENSSL_BUILD_SHLIBSSL
 #  undef OPENSSL_EXTERN
 #  define OPENSSL_EXTERN OPENSSL_EXPORT
@@ -323,6 +343,27 @@
  */
 # define TLS1_TLSTREE 0x20000
 
+/*
+ * TLSTREE leaf masks (the C3 constants of RFC 9189). Keys derived for a
+ * sequence number stay valid while the bits covered by the mask don't change.
+ */
+# define TLSTREE_MAGMA_LEAF_MASK        0xFFFFFFFFFFFFF000ULL
+# define TLSTREE_KUZNYECHIK_LEAF_MASK   0xFFFFFFFFFFFFE000ULL
+# define TLSTREE_NO_CACHE_MASK          0xFFFFFFFFFFFFFFFFULL
+
+/*
+ * Internal mac_flags: keys for this direction evolve with the record sequence
+ * number, see tls1_key_evolution_check()
+ */
+# define SSL_MAC_FLAG_READ_KEY_EVOLUTION   0x100
+# define SSL_MAC_FLAG_WRITE_KEY_EVOLUTION  0x200
+
+/* Largest supported key evolution interval, as log2 of the record count */
+# define SSL_KEY_EVOLUTION_MAX_BITS        62
+
+# define BTLS_MD_KEY_EVOLUTION_CONST       "btls key evolution"
+# define BTLS_MD_KEY_EVOLUTION_CONST_SIZE  18
+
 # define SSL_STRONG_MASK         0x0000001FU
 # define SSL_DEFAULT_MASK        0X00000020U
 
@@ -338,8 +379,13 @@
 /* Flag used on OpenSSL ciphersuite ids to indicate they are for SSLv3+ */
 # define SSL3_CK_CIPHERSUITE_FLAG                0x03000000
 
-/* Check if an SSL structure is using DTLS */
-# define SSL_IS_DTLS(s)  (s->method->ssl3_enc->enc_flags & SSL_ENC_FLAG_DTLS)
+/* Check if an SSL structure or method is using DTLS */
+# define SSL_METHOD_IS_DTLS(m) ((m)->ssl3_enc->enc_flags & SSL_ENC_FLAG_DTLS)
+# ifdef OPENSSL_BTLS_PROFILE
+#  define SSL_IS_DTLS(s)  ((void)(s), 0)
+# else
+#  define SSL_IS_DTLS(s)  SSL_METHOD_IS_DTLS(s->method)
+# endif
 
 /* Check if we are using TLSv1.3 */
 # define SSL_IS_TLS13(s) (!SSL_IS_DTLS(s) \
@@ -552,6 +598,13 @@ struct ssl_method_st {
  * Look in ssl/ssl_asn1.c for more details
  * I'm using EXPLICIT tags so I can read the damn things using asn1parse :-).
  */
+
+/* Refcounted pool of client certificates shared by sessions */
+typedef struct ssl_peer_pool_st SSL_PEER_POOL;
+
+/* Sharded counters of negotiated parameters */
+typedef struct ssl_neg_stats_st SSL_NEG_STATS;
+
 struct ssl_session_st {
     int ssl_version;            /* what ssl version session info is being kept
                                  * in here? */
@@ -588,6 +641,8 @@ struct ssl_session_st {
     X509 *peer;
     /* Certificate chain peer sent. */
     STACK_OF(X509) *peer_chain;
+    /* Pool that |peer| and |peer_chain| were taken from, if any */
+    SSL_PEER_POOL *peer_pool;
     /*
      * when app_verify_callback accepts a session where the peer's
      * certificate is not ok, we must remember the error for session reuse:
@@ -783,6 +838,7 @@ DEFINE_LHASH_OF(X509_NAME);
 typedef struct ssl_ctx_ext_secure_st {
     unsigned char tick_hmac_key[TLSEXT_TICK_KEY_LENGTH];
     unsigned char tick_aes_key[TLSEXT_TICK_KEY_LENGTH];
+    unsigned char tick_aead_key[TLSEXT_TICK_KEY_LENGTH];
 } SSL_CTX_EXT_SECURE;
 
 /*
@@ -839,6 +895,94 @@ typedef struct tls_group_info_st {
 
 # define TLS_GROUP_FFDHE_FOR_TLS1_3 (TLS_GROUP_FFDHE|TLS_GROUP_ONLY_FOR_TLS1_3)
 
+/*
+ * The references SSL objects hold on their SSL_CTX are spread over a number
+ * of shards, selected by thread, so that SSL_new()/SSL_free() on different
+ * cores do not all contend for |references|. A shard holds a single
+ * reference on the SSL_CTX while its count is non-zero. The counts are
+ * padded to a cache line each, so that the shards do not share one.
+ */
+# define SSL_CTX_REF_SHARDS         16
+# define SSL_CACHE_LINE_SIZE        64
+
+typedef union ssl_ctx_ref_shard_un {
+    CRYPTO_REF_COUNT count;
+    unsigned char pad[SSL_CACHE_LINE_SIZE];
+} SSL_CTX_REF_SHARD;
+
+/*
+ * Allocations of a freed SSL kept in its SSL_CTX, so that a later SSL can
+ * take them instead of allocating its own. Index 0 of the arrays is the read
+ * direction, index 1 the write direction.
+ */
+typedef struct ssl_conn_res_st {
+    struct ssl_conn_res_st *next;
+    unsigned char *buf[2];
+    size_t buf_len[2];
+    BUF_MEM *init_buf;
+    EVP_CIPHER_CTX *cipher_ctx[2];
+    EVP_MD_CTX *md_ctx[2];
+} SSL_CONN_RES;
+
+/*
+ * ECDSA nonces precomputed for |pkey|: each pair of k^-1 and r is used for
+ * one signature, see ssl_presign.c
+ */
+typedef struct ssl_presign_pool_st {
+    EVP_PKEY *pkey;
+    BIGNUM **kinv;
+    BIGNUM **rp;
+    size_t num;
+    size_t size;
+} SSL_PRESIGN_POOL;
+
+typedef struct ssl_psk_store_entry_st SSL_PSK_STORE_ENTRY;
+
+/* Open addressing hash table of external PSKs, see ssl_psk.c */
+typedef struct ssl_psk_store_st {
+    SSL_PSK_STORE_ENTRY **slots;
+    /* Number of slots minus one, the number of slots is a power of 2 */
+    size_t mask;
+    size_t num;
+    uint32_t seed;
+} SSL_PSK_STORE;
+
+/* An OCSP response to staple, shared by reference between connections */
+typedef struct ssl_ocsp_staple_st {
+    unsigned char *resp;
+    size_t resp_len;
+    /* Ask the fetcher for a new response from this time on */
+    time_t refresh_at;
+    /* Stop stapling the response from this time on, 0 for never */
+    time_t expire_at;
+    CRYPTO_REF_COUNT references;
+    CRYPTO_RWLOCK *lock;
+} SSL_OCSP_STAPLE;
+
+/*
+ * Starts fetching a fresh OCSP response for |x|, to be delivered later with
+ * SSL_CTX_set1_ocsp_staple(). Called from handshakes, so must not block.
+ */
+typedef int (*SSL_ocsp_fetch_cb_func)(SSL_CTX *ctx, X509 *x, void *arg);
+
+/*
+ * Runs |job|(|arg|, i) for every i below |njobs|, on any threads, and returns
+ * once all of them have completed.
+ */
+typedef void (*SSL_record_job_func)(void *arg, size_t i);
+typedef void (*SSL_record_parallel_cb_func)(void *cbarg,
+                                            SSL_record_job_func job,
+                                            void *arg, size_t njobs);
+
+/* Stapling cache slot, one per certificate type */
+typedef struct ssl_ocsp_cache_st {
+    /* Certificate |staple| is for, or NULL if the slot is unused */
+    X509 *x509;
+    SSL_OCSP_STAPLE *staple;
+    /* When the pending fetch was requested, 0 if there is none */
+    time_t fetch_started;
+} SSL_OCSP_CACHE;
+
 struct ssl_ctx_st {
     OSSL_LIB_CTX *libctx;
 
@@ -857,6 +1001,15 @@ struct ssl_ctx_st {
     size_t session_cache_size;
     struct ssl_session_st *session_cache_head;
     struct ssl_session_st *session_cache_tail;
+    /*
+     * Session cache shared with other processes, consulted after the one
+     * above. Not owned, see ssl_sess_shm.c.
+     */
+    void *shm_sess_cache;
+    /* Client certificates shared by the sessions above, if enabled */
+    SSL_PEER_POOL *peer_pool;
+    /* Counters of negotiated parameters, if enabled, see ssl_neg_stats.c */
+    SSL_NEG_STATS *neg_stats;
     /*
      * This can have one of 2 values, ored together, SSL_SESS_CACHE_CLIENT,
      * SSL_SESS_CACHE_SERVER, Default is SSL_SESSION_CACHE_SERVER, which
@@ -883,6 +1036,16 @@ struct ssl_ctx_st {
     SSL_SESSION *(*get_session_cb) (struct ssl_st *ssl,
                                     const unsigned char *data, int len,
                                     int *copy);
+    /*
+     * If set, the handshake suspends instead of calling |get_session_cb|,
+     * and the application supplies the session later, see ssl_sess.c
+     */
+    int async_session_lookup;
+    /*
+     * If not 0, how long in milliseconds a TLSv1.3 client may hold its
+     * Finished back to send it with the first application data
+     */
+    unsigned int finished_coalesce_ms;
     struct {
         TSAN_QUALIFIER int sess_connect;       /* SSL new conn - started */
         TSAN_QUALIFIER int sess_connect_renegotiate; /* SSL reneg - requested */
@@ -907,6 +1070,21 @@ struct ssl_ctx_st {
 #endif
 
     CRYPTO_REF_COUNT references;
+    SSL_CTX_REF_SHARD ref_shards[SSL_CTX_REF_SHARDS];
+
+    /* Resources of freed SSL objects, see SSL_CTX_set_conn_pool_size() */
+    SSL_CONN_RES *conn_pool;
+    size_t conn_pool_len;
+    size_t conn_pool_max;
+    CRYPTO_RWLOCK *conn_pool_lock;
+
+    /* Server side external PSKs, see SSL_CTX_set0_psk_store() */
+    SSL_PSK_STORE *psk_store;
+    CRYPTO_RWLOCK *psk_store_lock;
+
+    /* Precomputed nonces for signing with the ECDSA certificate key */
+    SSL_PRESIGN_POOL presign;
+    CRYPTO_RWLOCK *presign_lock;
 
     /* if defined, these override the X509_verify_cert() calls */
     int (*app_verify_callback) (X509_STORE_CTX *, void *);
@@ -1003,6 +1181,15 @@ struct ssl_ctx_st {
      */
     ssl_ct_validation_cb ct_validation_callback;
     void *ct_validation_callback_arg;
+    /* Bumped whenever |ctlog_store| may have changed */
+    uint32_t ctlog_store_gen;
+    /*
+     * Direct mapped cache of successful strict SCT validations, keyed by a
+     * digest of the certificate, issuer, SCT list and |ctlog_store_gen|.
+     */
+    unsigned char (*ct_cache)[SHA256_DIGEST_LENGTH];
+    size_t ct_cache_size;
+    CRYPTO_RWLOCK *ct_cache_lock;
 # endif
 
     /*
@@ -1018,9 +1205,21 @@ struct ssl_ctx_st {
 
     /* Up to how many pipelines should we use? If 0 then 1 is assumed */
     size_t max_pipelines;
+    /*
+     * Executor that encrypts the records of a pipelined TLSv1.3 write in
+     * parallel, which ciphers without pipeline support can't otherwise do
+     */
+    SSL_record_parallel_cb_func record_parallel_cb;
+    void *record_parallel_arg;
 
     /* The default read buffer length to use (0 means not set) */
     size_t default_read_buf_len;
+    /*
+     * Bounds of the adaptive read-ahead window, which is enabled if
+     * |read_buf_max| is not 0, see ssl3_read_n()
+     */
+    size_t read_buf_min;
+    size_t read_buf_max;
 
 # ifndef OPENSSL_NO_ENGINE
     /*
@@ -1041,6 +1240,13 @@ struct ssl_ctx_st {
         /* RFC 4507 session ticket keys */
         unsigned char tick_key_name[TLSEXT_KEYNAME_LENGTH];
         SSL_CTX_EXT_SECURE *secure;
+        /*
+         * Single-pass AEAD ticket format, used to seal tickets if |tick_aead|
+         * is set. Its key and key name are derived from the keys above.
+         */
+        unsigned char tick_aead_key_name[TLSEXT_KEYNAME_LENGTH];
+        EVP_CIPHER *tick_aead;
+        size_t tick_aead_taglen;
 # ifndef OPENSSL_NO_DEPRECATED_3_0
         /* Callback to support customisation of ticket key setting */
         int (*ticket_key_cb) (SSL *ssl,
@@ -1058,6 +1264,11 @@ struct ssl_ctx_st {
         void *status_arg;
         /* ext status type used for CSR extension (OCSP Stapling) */
         int status_type;
+        /* Built-in stapling cache, used before |status_cb| */
+        SSL_OCSP_CACHE ocsp_cache[SSL_PKEY_NUM];
+        CRYPTO_RWLOCK *ocsp_cache_lock;
+        SSL_ocsp_fetch_cb_func ocsp_fetch_cb;
+        void *ocsp_fetch_arg;
         /* RFC 4366 Maximum Fragment Length Negotiation */
         uint8_t max_fragment_len_mode;
 
@@ -1193,6 +1404,11 @@ struct ssl_ctx_st {
     const EVP_CIPHER *ssl_cipher_methods[SSL_ENC_NUM_IDX];
     const EVP_MD *ssl_digest_methods[SSL_MD_NUM_IDX];
     size_t ssl_mac_secret_size[SSL_MD_NUM_IDX];
+    /*
+     * Whether the HMAC-hbelt PRF of t1_enc.c matched the TLS1-PRF KDF: 0 if
+     * not checked yet, 1 if it did, -1 if the KDF must be used instead
+     */
+    TSAN_QUALIFIER int hbelt_prf_ok;
 
     /* Cache of all sigalgs we know and whether they are available or not */
     struct sigalg_lookup_st *sigalg_lookup_cache;
@@ -1206,10 +1422,59 @@ struct ssl_ctx_st {
     uint32_t disabled_mac_mask;
     uint32_t disabled_mkey_mask;
     uint32_t disabled_auth_mask;
+
+    /* BELT suites: rekey every 2^key_evolution_bits records, 0 disables */
+    unsigned int key_evolution_bits;
 };
 
 typedef struct cert_pkey_st CERT_PKEY;
 
+/*
+ * Per-direction cache of the TLSTREE-diversified MAC context, so the tree
+ * keys are only re-derived when the sequence number crosses a leaf boundary.
+ */
+typedef struct ssl_tlstree_st {
+    /* MAC context keyed for the leaf in |leaf|, or NULL if not derived */
+    EVP_MD_CTX *mac_ctx;
+    /* Sequence number bits which select the leaf */
+    uint64_t mask;
+    /* Masked sequence number |mac_ctx| was derived for */
+    uint64_t leaf;
+} SSL_TLSTREE;
+
+/*
+ * Sequence number driven key evolution for one record direction. The keys for
+ * the records of epoch (seq & mask) are derived from the keys installed by the
+ * handshake, so rekeying needs neither handshake messages nor public key
+ * operations.
+ */
+typedef struct ssl_key_evolution_st {
+    /* Sequence number bits which select the epoch */
+    uint64_t mask;
+    /* Epoch of the currently installed keys */
+    uint64_t epoch;
+    /* Digests for the PRF and the MAC, and the MAC key type */
+    const EVP_MD *prf_md;
+    const EVP_MD *mac_md;
+    int mac_type;
+    size_t mac_secret_size;
+    size_t key_len;
+    size_t iv_len;
+    /* mac secret || key || iv as installed by the handshake */
+    unsigned char root[EVP_MAX_MD_SIZE + EVP_MAX_KEY_LENGTH
+                       + EVP_MAX_IV_LENGTH];
+} SSL_KEY_EVOLUTION;
+
+/* Lookups in the external session cache done for the current ClientHello */
+# define SSL_SESS_LOOKUP_MAX    4
+
+typedef struct ssl_sess_lookup_result_st {
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    size_t id_len;
+    /* The session supplied by the application, or NULL on a miss */
+    SSL_SESSION *sess;
+} SSL_SESS_LOOKUP_RESULT;
+
 struct ssl_st {
     /*
      * protocol version (one of SSL2_VERSION, SSL3_VERSION, TLS1_VERSION,
@@ -1228,6 +1493,12 @@ struct ssl_st {
     BIO *wbio;
     /* used during session-id reuse to concatenate messages */
     BIO *bbio;
+    /*
+     * Set while the client Finished waits in |bbio| to leave together with
+     * the first application data, and since when
+     */
+    int finished_held;
+    struct timeval finished_held_at;
     /*
      * This holds a variable that indicates what we were doing when a 0 or -1
      * is returned.  This is needed for non-blocking IO so we know what
@@ -1324,6 +1595,13 @@ struct ssl_st {
             STACK_OF(X509_NAME) *peer_ca_names;
             size_t key_block_length;
             unsigned char *key_block;
+            /*
+             * HMAC keyed with the master secret for the PRF of the BTLS
+             * suites, and the key it was keyed with
+             */
+            EVP_MAC_CTX *prf_mac;
+            unsigned char prf_mac_key[SSL_MAX_MASTER_KEY_LENGTH];
+            size_t prf_mac_key_len;
             const EVP_CIPHER *new_sym_enc;
             const EVP_MD *new_hash;
             int new_mac_pkey_type;
@@ -1471,6 +1749,18 @@ struct ssl_st {
     unsigned char server_app_traffic_secret[EVP_MAX_MD_SIZE];
     unsigned char exporter_master_secret[EVP_MAX_MD_SIZE];
     unsigned char early_exporter_master_secret[EVP_MAX_MD_SIZE];
+    /*
+     * The client traffic keys of the current TLSv1.3 epoch, derived along
+     * with the server ones and used when the client side changes keys
+     */
+    struct {
+        const unsigned char *label;
+        unsigned char secret[EVP_MAX_MD_SIZE];
+        unsigned char key[EVP_MAX_KEY_LENGTH];
+        unsigned char iv[EVP_MAX_IV_LENGTH];
+    } tls13_next_keys;
+    /* TLSv1.3 KDF context, reused for every HKDF-Expand-Label */
+    EVP_KDF_CTX *tls13_kdf;
     EVP_CIPHER_CTX *enc_read_ctx; /* cryptographic state */
     unsigned char read_iv[EVP_MAX_IV_LENGTH]; /* TLSv1.3 static read IV */
     EVP_MD_CTX *read_hash;      /* used for mac generation */
@@ -1478,7 +1768,16 @@ struct ssl_st {
     COMP_CTX *expand;           /* uncompress */
     EVP_CIPHER_CTX *enc_write_ctx; /* cryptographic state */
     unsigned char write_iv[EVP_MAX_IV_LENGTH]; /* TLSv1.3 static write IV */
+    /* Copies of |enc_write_ctx| for encrypting pipelines in parallel */
+    EVP_CIPHER_CTX *enc_write_pipe_ctx[SSL_MAX_PIPELINES];
     EVP_MD_CTX *write_hash;     /* used for mac generation */
+    /* Derived TLSTREE MAC state, used if SSL_MAC_FLAG_*_MAC_TLSTREE is set */
+    SSL_TLSTREE tlstree_read;
+    SSL_TLSTREE tlstree_write;
+    /* Key evolution state, used if SSL_MAC_FLAG_*_KEY_EVOLUTION is set */
+    SSL_KEY_EVOLUTION key_evolution_read;
+    SSL_KEY_EVOLUTION key_evolution_write;
+    unsigned int key_evolution_bits;
     /* session info */
     /* client cert? */
     /* This is used to hold the server certificate used */
@@ -1515,6 +1814,16 @@ struct ssl_st {
      */
     unsigned char tmp_session_id[SSL_MAX_SSL_SESSION_ID_LENGTH];
     size_t tmp_session_id_len;
+    /* Asynchronous lookups in the external session cache */
+    struct {
+        int state;
+        /* The ID waited for while the lookup is pending */
+        unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+        size_t id_len;
+        /* Kept until processing of the ClientHello finishes */
+        SSL_SESS_LOOKUP_RESULT results[SSL_SESS_LOOKUP_MAX];
+        size_t nresults;
+    } sess_lookup;
     /* Used in SSL3 */
     /*
      * 0 don't care about verify failure.
@@ -1537,6 +1846,10 @@ struct ssl_st {
     SSL_psk_use_session_cb_func psk_use_session_cb;
 
     SSL_CTX *ctx;
+    /* Shard holding our reference on |ctx|, NULL for a plain reference */
+    SSL_CTX_REF_SHARD *ctx_ref;
+    /* Pooled resources not yet taken, or NULL */
+    SSL_CONN_RES *conn_res;
     /* Verified chain of peer */
     STACK_OF(X509) *verified_chain;
     long verify_result;
@@ -1602,6 +1915,8 @@ struct ssl_st {
             /* OCSP response received or to be sent */
             unsigned char *resp;
             size_t resp_len;
+            /* Cached response to be sent instead of |resp|, or NULL */
+            SSL_OCSP_STAPLE *staple;
         } ocsp;
 
         /* RFC4507 session ticket expected to be received or sent */
@@ -1713,6 +2028,7 @@ struct ssl_st {
     int scts_parsed;
 # endif
     SSL_CTX *session_ctx;       /* initial ctx, used to store sessions */
+    SSL_CTX_REF_SHARD *session_ctx_ref;
 # ifndef OPENSSL_NO_SRTP
     /* What we'll do */
     STACK_OF(SRTP_PROTECTION_PROFILE) *srtp_profiles;
@@ -1939,6 +2255,9 @@ typedef struct dtls1_state_st {
 #  define EXPLICIT_CHAR2_CURVE_TYPE  2
 #  define NAMED_CURVE_TYPE           3
 
+/* Distinct signature algorithms of a chain remembered in its CERT_PKEY */
+# define CERT_PKEY_MAX_CA_SIG_NIDS   4
+
 struct cert_pkey_st {
     X509 *x509;
     EVP_PKEY *privatekey;
@@ -1953,7 +2272,30 @@ struct cert_pkey_st {
      */
     unsigned char *serverinfo;
     size_t serverinfo_length;
+    /*
+     * Results of the tls1_check_chain() checks which depend only on the
+     * fields above, see ssl_cert_pkey_set_static_flags().
+     */
+    uint32_t static_flags;
+    /* TLS_CT_* type matching |privatekey|, or 0 */
+    int cert_type;
+    /* Key usage of |x509| */
+    uint32_t key_usage;
+    /* Signature algorithm of |x509|, and the distinct ones of |chain| */
+    int ee_sig_nid;
+    int ca_sig_nids[CERT_PKEY_MAX_CA_SIG_NIDS];
+    size_t ca_sig_nids_len;
 };
+
+/* |static_flags| and the fields which follow it are up to date */
+# define CERT_PKEY_STATIC_DONE      0x1
+/* End entity parameters are acceptable whatever the peer supports */
+# define CERT_PKEY_STATIC_EE_PARAM  0x2
+/* The same for all the CA certificates in the chain */
+# define CERT_PKEY_STATIC_CA_PARAM  0x4
+/* |ca_sig_nids| holds the signature algorithms of all of |chain| */
+# define CERT_PKEY_STATIC_CA_SIGS   0x8
+
 /* Retrieve Suite B flags */
 # define tls1_suiteb(s)  (s->cert->cert_flags & SSL_CERT_FLAG_SUITEB_128_LOS)
 /* Uses to check strict mode: suite B modes are always strict */
@@ -2358,6 +2700,113 @@ struct openssl_ssl_test_functions {
 
 const char *ssl_protocol_to_string(int version);
 
+/*
+ * Public API of this tree that is not declared in <openssl/ssl.h>
+ */
+
+/* BELT key evolution */
+int SSL_CTX_set_key_evolution_bits(SSL_CTX *ctx, unsigned int bits);
+unsigned int SSL_CTX_get_key_evolution_bits(const SSL_CTX *ctx);
+int SSL_set_key_evolution_bits(SSL *s, unsigned int bits);
+unsigned int SSL_get_key_evolution_bits(const SSL *s);
+
+/* Zero-copy reads */
+int SSL_read_borrow(SSL *s, const unsigned char **data, size_t *len);
+int SSL_read_release(SSL *s, size_t len);
+
+/* Adaptive read buffer sizing */
+int SSL_CTX_set_read_buffer_bounds(SSL_CTX *ctx, size_t min, size_t max);
+
+/* Counters of negotiated parameters */
+# define SSL_NEG_STAT_CIPHER    0
+# define SSL_NEG_STAT_GROUP     1
+# define SSL_NEG_STAT_SIGALG    2
+# define SSL_NEG_STAT_VERSION   3
+int SSL_CTX_set_negotiation_stats(SSL_CTX *ctx, int onoff);
+uint64_t SSL_CTX_get_negotiation_count(SSL_CTX *ctx, int kind,
+                                       unsigned int id);
+int SSL_CTX_negotiation_stats(SSL_CTX *ctx, int kind,
+                              void (*cb)(unsigned int id, uint64_t count,
+                                         void *arg),
+                              void *arg);
+
+/* Asynchronous lookups in the external session cache */
+# define SSL_SESSION_LOOKUP             9
+# define SSL_ERROR_WANT_SESSION_LOOKUP  13
+# define SSL_want_session_lookup(s)     (SSL_want(s) == SSL_SESSION_LOOKUP)
+typedef int (*SSL_multi_get_session_cb_func)(const unsigned char **ids,
+                                             const size_t *id_lens,
+                                             size_t n, SSL_SESSION **sessions,
+                                             void *arg);
+void SSL_CTX_set_async_session_lookup(SSL_CTX *ctx, int onoff);
+const unsigned char *SSL_get0_session_lookup_id(const SSL *s, size_t *len);
+int SSL_set1_session_lookup_result(SSL *s, SSL_SESSION *sess);
+size_t SSL_lookup_sessions(SSL **ssls, size_t n,
+                           SSL_multi_get_session_cb_func cb, void *arg);
+
+/* Session tickets sealed with an AEAD */
+int SSL_CTX_set_ticket_aead(SSL_CTX *ctx, const char *name);
+
+/* Coalescing of the client Finished with the first application data */
+void SSL_CTX_set_finished_coalescing(SSL_CTX *ctx, unsigned int timeout_ms);
+int SSL_get_coalescing_timeout(SSL *s, struct timeval *timeleft);
+int SSL_handle_coalescing_timeout(SSL *s);
+
+/* Forwarding of application data between connections */
+int SSL_forward(SSL *in, SSL *out, size_t max, size_t *forwarded);
+
+/* Ring buffer BIO lending its memory, for in-process transports */
+# define BIO_TYPE_RING          (0x60 | BIO_TYPE_SOURCE_SINK)
+const BIO_METHOD *BIO_s_ring(void);
+BIO *BIO_new_ring(size_t size);
+size_t BIO_ring_write_buf(BIO *b, unsigned char **buf);
+int BIO_ring_write_commit(BIO *b, size_t n);
+size_t BIO_ring_read_buf(BIO *b, const unsigned char **buf);
+int BIO_ring_read_commit(BIO *b, size_t n);
+
+/* Reuse of buffers and crypto contexts across connections */
+int SSL_CTX_set_conn_pool_size(SSL_CTX *ctx, size_t size);
+size_t SSL_CTX_get_conn_pool_size(const SSL_CTX *ctx);
+
+/* Built-in external PSK table */
+SSL_PSK_STORE *SSL_PSK_STORE_new(size_t expected);
+void SSL_PSK_STORE_free(SSL_PSK_STORE *store);
+int SSL_PSK_STORE_add(SSL_PSK_STORE *store, const unsigned char *identity,
+                      size_t identity_len, const unsigned char *psk,
+                      size_t psk_len, const SSL_CIPHER *cipher);
+int SSL_CTX_set0_psk_store(SSL_CTX *ctx, SSL_PSK_STORE *store);
+
+/* Built-in OCSP stapling cache */
+void SSL_CTX_set_ocsp_fetch_cb(SSL_CTX *ctx, SSL_ocsp_fetch_cb_func cb,
+                               void *arg);
+int SSL_CTX_set1_ocsp_staple(SSL_CTX *ctx, X509 *x, const unsigned char *resp,
+                             size_t resp_len, time_t refresh_at,
+                             time_t expire_at);
+
+/* Parallel encryption of pipelined TLSv1.3 records */
+void SSL_CTX_set_record_parallel_cb(SSL_CTX *ctx,
+                                    SSL_record_parallel_cb_func cb,
+                                    void *arg);
+
+/* Offline/online signing with precomputed ECDSA nonces */
+int SSL_CTX_set_presign_pool_size(SSL_CTX *ctx, size_t size);
+size_t SSL_CTX_get_presign_pool_size(const SSL_CTX *ctx);
+int SSL_CTX_fill_presign_pool(SSL_CTX *ctx);
+
+/* Sharing of client certificates between cached sessions */
+int SSL_CTX_set_peer_cert_pool(SSL_CTX *ctx, int onoff);
+
+/* Session cache in memory shared between processes */
+size_t SSL_shm_session_cache_size(size_t nsessions, size_t max_der_len);
+int SSL_shm_session_cache_init(void *mem, size_t len, size_t max_der_len);
+int SSL_CTX_set_shm_session_cache(SSL_CTX *ctx, void *mem);
+
+# ifndef OPENSSL_NO_CT
+/* SCT validation cache */
+int SSL_CTX_set_ct_cache_size(SSL_CTX *ctx, size_t size);
+size_t SSL_CTX_get_ct_cache_size(const SSL_CTX *ctx);
+# endif
+
 /* Returns true if certificate and private key for 'idx' are present */
 static ossl_inline int ssl_has_cert(const SSL *s, int idx)
 {
@@ -2383,12 +2832,19 @@ int ssl_clear_bad_session(SSL *s);
 __owur CERT *ssl_cert_new(void);
 __owur CERT *ssl_cert_dup(CERT *cert);
 void ssl_cert_clear_certs(CERT *c);
+void ssl_cert_pkey_set_static_flags(CERT_PKEY *cpk);
 void ssl_cert_free(CERT *c);
 __owur int ssl_generate_session_id(SSL *s, SSL_SESSION *ss);
 __owur int ssl_get_new_session(SSL *s, int session);
 __owur SSL_SESSION *lookup_sess_in_cache(SSL *s, const unsigned char *sess_id,
                                          size_t sess_id_len);
 __owur int ssl_get_prev_session(SSL *s, CLIENTHELLO_MSG *hello);
+/* States of an asynchronous session lookup */
+#  define SSL_SESS_LOOKUP_NONE      0
+#  define SSL_SESS_LOOKUP_PENDING   1
+#  define SSL_SESS_LOOKUP_READY     2
+void ssl_sess_lookup_clear(SSL *s);
+__owur int tls_derive_aead_ticket_key(SSL_CTX *ctx);
 __owur SSL_SESSION *ssl_session_dup(const SSL_SESSION *src, int ticket);
 __owur int ssl_cipher_id_cmp(const SSL_CIPHER *a, const SSL_CIPHER *b);
 DECLARE_OBJ_BSEARCH_GLOBAL_CMP_FN(SSL_CIPHER, SSL_CIPHER, ssl_cipher_id);
@@ -2566,6 +3022,7 @@ void dtls1_get_message_header(unsigned char *data,
                               struct hm_header_st *msg_hdr);
 __owur long dtls1_default_timeout(void);
 __owur struct timeval *dtls1_get_timeout(SSL *s, struct timeval *timeleft);
+void ssl_get_current_time(struct timeval *t);
 __owur int dtls1_check_timeout_num(SSL *s);
 __owur int dtls1_handle_timeout(SSL *s);
 void dtls1_start_timer(SSL *s);
@@ -2591,8 +3048,13 @@ __owur int dtls1_dispatch_alert(SSL *s);
 
 __owur int ssl_init_wbio_buffer(SSL *s);
 int ssl_free_wbio_buffer(SSL *s);
+__owur int ssl_hold_finished(SSL *s);
+__owur int ssl_release_finished(SSL *s);
 
 __owur int tls1_change_cipher_state(SSL *s, int which);
+void ssl_tlstree_reset(SSL_TLSTREE *tree, uint64_t mask);
+void ssl_key_evolution_reset(SSL_KEY_EVOLUTION *ke);
+__owur int tls1_key_evolution_check(SSL *s, int sending);
 __owur int tls1_setup_key_block(SSL *s);
 __owur size_t tls1_final_finish_mac(SSL *s, const char *str, size_t slen,
                                     unsigned char *p);
@@ -2706,6 +3168,49 @@ __owur int ssl_security_cert_chain(SSL *s, STACK_OF(X509) *sk, X509 *ex,
 int tls_choose_sigalg(SSL *s, int fatalerrs);
 
 __owur EVP_MD_CTX *ssl_replace_hash(EVP_MD_CTX **hash, const EVP_MD *md);
+size_t ssl_thread_shard(size_t nshards);
+unsigned char *ssl_conn_res_take_buf(SSL *s, int sending, size_t len);
+BUF_MEM *ssl_conn_res_take_init_buf(SSL *s);
+EVP_CIPHER_CTX *ssl_conn_res_take_cipher_ctx(SSL *s, int sending);
+EVP_MD_CTX *ssl_conn_res_take_md_ctx(SSL *s, int sending);
+
+/* ssl_staple.c */
+__owur int ssl_ocsp_cache_get(SSL *s);
+void ssl_ocsp_staple_free(SSL_OCSP_STAPLE *staple);
+void ssl_ocsp_cache_free(SSL_CTX *ctx);
+
+/* ssl_sess_shm.c */
+int ssl_shm_sess_add(SSL_CTX *ctx, SSL_SESSION *sess);
+__owur SSL_SESSION *ssl_shm_sess_get(SSL *s, const unsigned char *sid,
+                                     size_t sid_len);
+void ssl_shm_sess_remove(SSL_CTX *ctx, const SSL_SESSION *sess);
+
+/* ssl_peer_pool.c */
+void ssl_peer_pool_intern(SSL_CTX *ctx, SSL_SESSION *sess);
+void ssl_peer_pool_release(SSL_SESSION *sess);
+void ssl_peer_pool_ctx_free(SSL_CTX *ctx);
+
+/* ssl_presign.c */
+__owur int ssl_presign_sign(SSL *s, const SIGALG_LOOKUP *lu, EVP_PKEY *pkey,
+                            const EVP_MD *md, const unsigned char *tbs,
+                            size_t tbslen, unsigned char **sig,
+                            size_t *siglen);
+void ssl_presign_pool_free(SSL_CTX *ctx);
+
+/* ssl_neg_stats.c */
+void ssl_neg_stats_count(SSL *s, int kind, unsigned int id);
+void ssl_neg_stats_ctx_free(SSL_CTX *ctx);
+
+/* bio_ring.c */
+unsigned char *ssl_ring_lend_wbuf(SSL *s, size_t len);
+
+/* ssl_psk.c */
+__owur int ssl_psk_store_find(SSL *s, const unsigned char *identity,
+                              size_t identity_len, unsigned char *psk,
+                              size_t *psk_len, const SSL_CIPHER **cipher);
+__owur int ssl_psk_store_find_session(SSL *s, const unsigned char *identity,
+                                      size_t identity_len,
+                                      SSL_SESSION **sess);
 void ssl_clear_hash_ctx(EVP_MD_CTX **hash);
 __owur long ssl_get_algorithm2(SSL *s);
 __owur int tls12_copy_sigalgs(SSL *s, WPACKET *pkt,
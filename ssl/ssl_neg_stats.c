@@ -0,0 +1,191 @@
+/*
+ * Copyright 2022 The OpenSSL Project Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Counters of the parameters negotiated by the connections of an SSL_CTX:
+ * cipher suites, groups, signature algorithms and protocol versions. The
+ * handshake code counts each choice as it is made. The counters are spread
+ * over shards selected by thread, like the SSL_CTX references, so that
+ * handshakes on different cores do not contend. Reading them sums the shards.
+ */
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include "ssl_local.h"
+
+/* Distinct parameters counted per shard, across all kinds */
+#define NEG_STAT_SLOTS  128
+
+typedef struct neg_stat_shard_st {
+    CRYPTO_RWLOCK *lock;
+    /* (kind << 16 | id) + 1 for a used slot, 0 for a free one */
+    uint32_t key[NEG_STAT_SLOTS];
+    uint64_t count[NEG_STAT_SLOTS];
+} NEG_STAT_SHARD;
+
+struct ssl_neg_stats_st {
+    NEG_STAT_SHARD shards[SSL_CTX_REF_SHARDS];
+};
+
+static void neg_stats_free(SSL_NEG_STATS *stats)
+{
+    size_t i;
+
+    if (stats == NULL)
+        return;
+    for (i = 0; i < SSL_CTX_REF_SHARDS; i++)
+        CRYPTO_THREAD_lock_free(stats->shards[i].lock);
+    OPENSSL_free(stats);
+}
+
+/*
+ * Enables or disables the negotiation counters of |ctx|, which start at 0.
+ * Must not be called while |ctx| is in use by connections.
+ */
+int SSL_CTX_set_negotiation_stats(SSL_CTX *ctx, int onoff)
+{
+    SSL_NEG_STATS *stats;
+    size_t i;
+
+    if (!onoff) {
+        neg_stats_free(ctx->neg_stats);
+        ctx->neg_stats = NULL;
+        return 1;
+    }
+    if (ctx->neg_stats != NULL)
+        return 1;
+
+    if ((stats = OPENSSL_zalloc(sizeof(*stats))) == NULL) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    for (i = 0; i < SSL_CTX_REF_SHARDS; i++) {
+        if ((stats->shards[i].lock = CRYPTO_THREAD_lock_new()) == NULL) {
+            neg_stats_free(stats);
+            ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+            return 0;
+        }
+    }
+    ctx->neg_stats = stats;
+    return 1;
+}
+
+void ssl_neg_stats_ctx_free(SSL_CTX *ctx)
+{
+    neg_stats_free(ctx->neg_stats);
+}
+
+/*
+ * Returns the slot of |key| in |shard|, or the free slot to put it in, or -1
+ * if it is neither there nor can be added. Must be called with the lock held.
+ */
+static int neg_stat_slot(const NEG_STAT_SHARD *shard, uint32_t key)
+{
+    size_t i, n;
+
+    for (n = 0, i = key % NEG_STAT_SLOTS; n < NEG_STAT_SLOTS;
+         n++, i = (i + 1) % NEG_STAT_SLOTS) {
+        if (shard->key[i] == key || shard->key[i] == 0)
+            return (int)i;
+    }
+    return -1;
+}
+
+/* Counts a negotiation of the parameter |id| of the given |kind| by |s| */
+void ssl_neg_stats_count(SSL *s, int kind, unsigned int id)
+{
+    SSL_NEG_STATS *stats = s->ctx->neg_stats;
+    NEG_STAT_SHARD *shard;
+    uint32_t key;
+    int i;
+
+    if (stats == NULL)
+        return;
+    key = (((uint32_t)kind << 16) | (id & 0xffff)) + 1;
+    shard = &stats->shards[ssl_thread_shard(SSL_CTX_REF_SHARDS)];
+    if (!CRYPTO_THREAD_write_lock(shard->lock))
+        return;
+    if ((i = neg_stat_slot(shard, key)) >= 0) {
+        shard->key[i] = key;
+        shard->count[i]++;
+    }
+    CRYPTO_THREAD_unlock(shard->lock);
+}
+
+/* Returns how many times |ctx| negotiated the parameter |id| of |kind| */
+uint64_t SSL_CTX_get_negotiation_count(SSL_CTX *ctx, int kind,
+                                       unsigned int id)
+{
+    SSL_NEG_STATS *stats = ctx->neg_stats;
+    NEG_STAT_SHARD *shard;
+    uint32_t key;
+    uint64_t total = 0;
+    size_t n;
+    int i;
+
+    if (stats == NULL || kind < 0 || kind > SSL_NEG_STAT_VERSION)
+        return 0;
+    key = (((uint32_t)kind << 16) | (id & 0xffff)) + 1;
+    for (n = 0; n < SSL_CTX_REF_SHARDS; n++) {
+        shard = &stats->shards[n];
+        if (!CRYPTO_THREAD_read_lock(shard->lock))
+            continue;
+        if ((i = neg_stat_slot(shard, key)) >= 0 && shard->key[i] == key)
+            total += shard->count[i];
+        CRYPTO_THREAD_unlock(shard->lock);
+    }
+    return total;
+}
+
+/*
+ * Calls |cb| once for each parameter of |kind| that |ctx| negotiated, with
+ * its id and count, in no particular order. Returns 0 if the counters are
+ * not enabled.
+ */
+int SSL_CTX_negotiation_stats(SSL_CTX *ctx, int kind,
+                              void (*cb)(unsigned int id, uint64_t count,
+                                         void *arg),
+                              void *arg)
+{
+    SSL_NEG_STATS *stats = ctx->neg_stats;
+    NEG_STAT_SHARD *shard;
+    uint32_t key;
+    size_t n, m, i;
+    int j, seen;
+
+    if (stats == NULL || kind < 0 || kind > SSL_NEG_STAT_VERSION) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_PASSED_INVALID_ARGUMENT);
+        return 0;
+    }
+    for (n = 0; n < SSL_CTX_REF_SHARDS; n++) {
+        shard = &stats->shards[n];
+        for (i = 0; i < NEG_STAT_SLOTS; i++) {
+            if (!CRYPTO_THREAD_read_lock(shard->lock))
+                break;
+            key = shard->key[i];
+            CRYPTO_THREAD_unlock(shard->lock);
+            if (key == 0 || ((key - 1) >> 16) != (uint32_t)kind)
+                continue;
+
+            /* Report each parameter from the first shard that has it */
+            for (seen = 0, m = 0; m < n && !seen; m++) {
+                if (!CRYPTO_THREAD_read_lock(stats->shards[m].lock))
+                    continue;
+                j = neg_stat_slot(&stats->shards[m], key);
+                seen = j >= 0 && stats->shards[m].key[j] == key;
+                CRYPTO_THREAD_unlock(stats->shards[m].lock);
+            }
+            if (!seen)
+                cb((key - 1) & 0xffff,
+                   SSL_CTX_get_negotiation_count(ctx, kind, (key - 1) & 0xffff),
+                   arg);
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright 2022 The OpenSSL Project Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Pool of the client certificates held by the sessions of a server SSL_CTX.
+ * When many sessions are established with few distinct client certificates,
+ * each session would otherwise hold its own parsed copy of the same
+ * certificates. Sessions instead share the pooled X509 objects, and a pool
+ * entry lives as long as a session uses it.
+ */
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/sha.h>
+#include "internal/refcount.h"
+#include "ssl_local.h"
+
+typedef struct ssl_peer_pool_entry_st {
+    X509 *x;
+    /* Number of pooled sessions holding |x| */
+    size_t uses;
+} SSL_PEER_POOL_ENTRY;
+
+DEFINE_LHASH_OF(SSL_PEER_POOL_ENTRY);
+
+struct ssl_peer_pool_st {
+    LHASH_OF(SSL_PEER_POOL_ENTRY) *certs;
+    CRYPTO_RWLOCK *lock;
+    CRYPTO_REF_COUNT references;
+};
+
+static unsigned long peer_pool_hash(const SSL_PEER_POOL_ENTRY *ent)
+{
+    unsigned char md[SHA_DIGEST_LENGTH];
+
+    /*
+     * The SHA1 fingerprint was cached when the certificate was verified, so
+     * this does not hash the certificate again
+     */
+    if (!X509_digest(ent->x, EVP_sha1(), md, NULL))
+        return 0;
+    return (unsigned long)md[0] | ((unsigned long)md[1] << 8)
+           | ((unsigned long)md[2] << 16) | ((unsigned long)md[3] << 24);
+}
+
+static int peer_pool_cmp(const SSL_PEER_POOL_ENTRY *a,
+                         const SSL_PEER_POOL_ENTRY *b)
+{
+    return X509_cmp(a->x, b->x);
+}
+
+static SSL_PEER_POOL *peer_pool_new(void)
+{
+    SSL_PEER_POOL *pool = OPENSSL_zalloc(sizeof(*pool));
+
+    if (pool == NULL
+            || (pool->certs = lh_SSL_PEER_POOL_ENTRY_new(peer_pool_hash,
+                                                         peer_pool_cmp))
+               == NULL
+            || (pool->lock = CRYPTO_THREAD_lock_new()) == NULL) {
+        if (pool != NULL)
+            lh_SSL_PEER_POOL_ENTRY_free(pool->certs);
+        OPENSSL_free(pool);
+        ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+        return NULL;
+    }
+    pool->references = 1;
+    return pool;
+}
+
+static void peer_pool_free(SSL_PEER_POOL *pool)
+{
+    int i;
+
+    if (pool == NULL)
+        return;
+    CRYPTO_DOWN_REF(&pool->references, &i, pool->lock);
+    REF_PRINT_COUNT("SSL_PEER_POOL", pool);
+    if (i > 0)
+        return;
+    REF_ASSERT_ISNT(i < 0);
+
+    /* Every session released its entries, so the table is empty */
+    lh_SSL_PEER_POOL_ENTRY_free(pool->certs);
+    CRYPTO_THREAD_lock_free(pool->lock);
+    OPENSSL_free(pool);
+}
+
+/*
+ * Enables or disables the pooling of client certificates for the sessions of
+ * |ctx|. Must not be called while |ctx| is in use by connections.
+ */
+int SSL_CTX_set_peer_cert_pool(SSL_CTX *ctx, int onoff)
+{
+    if (!onoff) {
+        peer_pool_free(ctx->peer_pool);
+        ctx->peer_pool = NULL;
+        return 1;
+    }
+    if (ctx->peer_pool == NULL && (ctx->peer_pool = peer_pool_new()) == NULL)
+        return 0;
+    return 1;
+}
+
+void ssl_peer_pool_ctx_free(SSL_CTX *ctx)
+{
+    peer_pool_free(ctx->peer_pool);
+}
+
+/*
+ * Returns the pooled certificate equal to |x|, adding |x| to the pool if there
+ * is none, and counts a use of it. Returns |x| itself, uncounted, if it can't
+ * be added. Must be called with the write lock held.
+ */
+static X509 *peer_pool_get(SSL_PEER_POOL *pool, X509 *x)
+{
+    SSL_PEER_POOL_ENTRY tmp, *ent;
+
+    tmp.x = x;
+    ent = lh_SSL_PEER_POOL_ENTRY_retrieve(pool->certs, &tmp);
+    if (ent == NULL) {
+        if ((ent = OPENSSL_zalloc(sizeof(*ent))) == NULL)
+            return x;
+        ent->x = x;
+        X509_up_ref(x);
+        lh_SSL_PEER_POOL_ENTRY_insert(pool->certs, ent);
+        if (lh_SSL_PEER_POOL_ENTRY_error(pool->certs)) {
+            X509_free(x);
+            OPENSSL_free(ent);
+            return x;
+        }
+    }
+    ent->uses++;
+    if (ent->x != x) {
+        X509_up_ref(ent->x);
+        X509_free(x);
+    }
+    return ent->x;
+}
+
+/*
+ * Drops a use of |x|. Certificates which could not be pooled were not counted
+ * and are told apart by not being the pooled object itself, since no other
+ * session can hold them. Must be called with the write lock held.
+ */
+static void peer_pool_put(SSL_PEER_POOL *pool, X509 *x)
+{
+    SSL_PEER_POOL_ENTRY tmp, *ent;
+
+    tmp.x = x;
+    ent = lh_SSL_PEER_POOL_ENTRY_retrieve(pool->certs, &tmp);
+    if (ent == NULL || ent->x != x || --ent->uses > 0)
+        return;
+    lh_SSL_PEER_POOL_ENTRY_delete(pool->certs, ent);
+    X509_free(ent->x);
+    OPENSSL_free(ent);
+}
+
+/*
+ * Replaces the peer certificates of |sess|, just received by a server using
+ * |ctx|, with the pooled ones. This must happen before the certificates are
+ * visible to anything else, as the replaced ones are freed.
+ */
+void ssl_peer_pool_intern(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    SSL_PEER_POOL *pool = ctx->peer_pool;
+    int i;
+
+    if (pool == NULL || sess->peer == NULL || sess->peer_pool != NULL
+            || !CRYPTO_THREAD_write_lock(pool->lock))
+        return;
+    sess->peer = peer_pool_get(pool, sess->peer);
+    for (i = 0; i < sk_X509_num(sess->peer_chain); i++)
+        sk_X509_set(sess->peer_chain, i,
+                    peer_pool_get(pool, sk_X509_value(sess->peer_chain, i)));
+    CRYPTO_THREAD_unlock(pool->lock);
+
+    CRYPTO_UP_REF(&pool->references, &i, pool->lock);
+    sess->peer_pool = pool;
+}
+
+/*
+ * Drops the uses of pooled certificates by |sess|, which is about to free or
+ * replace its peer certificates.
+ */
+void ssl_peer_pool_release(SSL_SESSION *sess)
+{
+    SSL_PEER_POOL *pool = sess->peer_pool;
+    int i;
+
+    if (pool == NULL)
+        return;
+    sess->peer_pool = NULL;
+    if (CRYPTO_THREAD_write_lock(pool->lock)) {
+        if (sess->peer != NULL)
+            peer_pool_put(pool, sess->peer);
+        for (i = 0; i < sk_X509_num(sess->peer_chain); i++)
+            peer_pool_put(pool, sk_X509_value(sess->peer_chain, i));
+        CRYPTO_THREAD_unlock(pool->lock);
+    }
+    peer_pool_free(pool);
+}
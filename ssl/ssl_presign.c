@@ -0,0 +1,211 @@
+/*
+ * Copyright 2022 The OpenSSL Project Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * ECDSA_sign_setup() and ECDSA_do_sign_ex() are deprecated for public use,
+ * but are the only way to split an ECDSA signature in two.
+ */
+#include "internal/deprecated.h"
+
+/*
+ * Offline/online ECDSA signing for the handshake signatures of an SSL_CTX.
+ * The costly part of a signature, the multiplication k*G giving r and the
+ * inversion of k, does not depend on the message. The application computes
+ * these ahead of time, in idle periods, with SSL_CTX_fill_presign_pool(),
+ * and each handshake signature then only costs a few modular operations.
+ * Every precomputed nonce is used at most once.
+ */
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/ec.h>
+#include "ssl_local.h"
+
+#if !defined(OPENSSL_NO_EC) && !defined(OPENSSL_NO_DEPRECATED_3_0)
+# define PRESIGN_ECDSA
+#endif
+
+static void presign_pool_flush(SSL_PRESIGN_POOL *pool)
+{
+    while (pool->num > 0) {
+        pool->num--;
+        BN_clear_free(pool->kinv[pool->num]);
+        BN_clear_free(pool->rp[pool->num]);
+    }
+    EVP_PKEY_free(pool->pkey);
+    pool->pkey = NULL;
+}
+
+void ssl_presign_pool_free(SSL_CTX *ctx)
+{
+    presign_pool_flush(&ctx->presign);
+    OPENSSL_free(ctx->presign.kinv);
+    OPENSSL_free(ctx->presign.rp);
+    CRYPTO_THREAD_lock_free(ctx->presign_lock);
+}
+
+/*
+ * Sets the number of nonces kept ready for the ECDSA key of |ctx|. 0, the
+ * default, disables precomputation.
+ */
+int SSL_CTX_set_presign_pool_size(SSL_CTX *ctx, size_t size)
+{
+    SSL_PRESIGN_POOL *pool = &ctx->presign;
+    BIGNUM **kinv = NULL, **rp = NULL;
+
+#ifndef PRESIGN_ECDSA
+    if (size > 0) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_UNSUPPORTED);
+        return 0;
+    }
+#endif
+    if (size > 0
+            && ((kinv = OPENSSL_malloc(size * sizeof(*kinv))) == NULL
+                || (rp = OPENSSL_malloc(size * sizeof(*rp))) == NULL)) {
+        OPENSSL_free(kinv);
+        ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+
+    if (!CRYPTO_THREAD_write_lock(ctx->presign_lock)) {
+        OPENSSL_free(kinv);
+        OPENSSL_free(rp);
+        return 0;
+    }
+    presign_pool_flush(pool);
+    OPENSSL_free(pool->kinv);
+    OPENSSL_free(pool->rp);
+    pool->kinv = kinv;
+    pool->rp = rp;
+    pool->size = size;
+    CRYPTO_THREAD_unlock(ctx->presign_lock);
+    return 1;
+}
+
+size_t SSL_CTX_get_presign_pool_size(const SSL_CTX *ctx)
+{
+    return ctx->presign.size;
+}
+
+/*
+ * Tops up the nonces for the ECDSA certificate key of |ctx|, meant to be
+ * called when the application is idle. Returns the number of nonces added,
+ * or -1 on error.
+ */
+int SSL_CTX_fill_presign_pool(SSL_CTX *ctx)
+{
+#ifdef PRESIGN_ECDSA
+    SSL_PRESIGN_POOL *pool = &ctx->presign;
+    EVP_PKEY *pkey = ctx->cert->pkeys[SSL_PKEY_ECC].privatekey;
+    EC_KEY *eckey;
+    BIGNUM *kinv, *rp;
+    size_t need;
+    int added = 0;
+
+    if (pkey == NULL || pool->size == 0)
+        return 0;
+    if ((eckey = (EC_KEY *)EVP_PKEY_get0_EC_KEY(pkey)) == NULL)
+        return -1;
+
+    if (!CRYPTO_THREAD_write_lock(ctx->presign_lock))
+        return -1;
+    /* Nonces computed for a replaced key are of no use */
+    if (pool->pkey != pkey) {
+        presign_pool_flush(pool);
+        EVP_PKEY_up_ref(pkey);
+        pool->pkey = pkey;
+    }
+    need = pool->size - pool->num;
+    CRYPTO_THREAD_unlock(ctx->presign_lock);
+
+    /* The scalar multiplications are done without holding the lock */
+    for (; need > 0; need--) {
+        kinv = rp = NULL;
+        if (!ECDSA_sign_setup(eckey, NULL, &kinv, &rp))
+            return added > 0 ? added : -1;
+        if (!CRYPTO_THREAD_write_lock(ctx->presign_lock)) {
+            BN_clear_free(kinv);
+            BN_clear_free(rp);
+            return -1;
+        }
+        if (pool->pkey != pkey || pool->num >= pool->size) {
+            CRYPTO_THREAD_unlock(ctx->presign_lock);
+            BN_clear_free(kinv);
+            BN_clear_free(rp);
+            break;
+        }
+        pool->kinv[pool->num] = kinv;
+        pool->rp[pool->num] = rp;
+        pool->num++;
+        CRYPTO_THREAD_unlock(ctx->presign_lock);
+        added++;
+    }
+    return added;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Signs |tbs| for the signature algorithm |lu| with |pkey| using a nonce from
+ * the pool of the SSL_CTX of |s|. On success |*sig| is set to the DER encoded
+ * signature, to be freed by the caller, and 1 is returned. Returns 0 when the
+ * signature must be made the usual way instead: the algorithm is not ECDSA,
+ * the pool is empty or the signing fails.
+ */
+int ssl_presign_sign(SSL *s, const SIGALG_LOOKUP *lu, EVP_PKEY *pkey,
+                     const EVP_MD *md, const unsigned char *tbs,
+                     size_t tbslen, unsigned char **sig, size_t *siglen)
+{
+#ifdef PRESIGN_ECDSA
+    SSL_PRESIGN_POOL *pool = &s->ctx->presign;
+    unsigned char dgst[EVP_MAX_MD_SIZE], *p;
+    unsigned int dgstlen;
+    BIGNUM *kinv = NULL, *rp = NULL;
+    ECDSA_SIG *esig = NULL;
+    int len, ret = 0;
+
+    /* Unlocked check for the common case of an empty or disabled pool */
+    if (lu->sig != EVP_PKEY_EC || md == NULL || pool->num == 0
+            || !CRYPTO_THREAD_write_lock(s->ctx->presign_lock))
+        return 0;
+    if (pool->pkey == pkey && pool->num > 0) {
+        pool->num--;
+        kinv = pool->kinv[pool->num];
+        rp = pool->rp[pool->num];
+    }
+    CRYPTO_THREAD_unlock(s->ctx->presign_lock);
+    if (kinv == NULL)
+        return 0;
+
+    /* A failure here is not fatal, the caller signs the usual way */
+    ERR_set_mark();
+    if (EVP_Digest(tbs, tbslen, dgst, &dgstlen, md, NULL)
+            && (esig = ECDSA_do_sign_ex(dgst, (int)dgstlen, kinv, rp,
+                                        (EC_KEY *)EVP_PKEY_get0_EC_KEY(pkey)))
+               != NULL
+            && (len = i2d_ECDSA_SIG(esig, NULL)) > 0
+            && (*sig = p = OPENSSL_malloc(len)) != NULL) {
+        *siglen = i2d_ECDSA_SIG(esig, &p);
+        ret = 1;
+    }
+    if (ret)
+        ERR_clear_last_mark();
+    else
+        ERR_pop_to_mark();
+
+    ECDSA_SIG_free(esig);
+    BN_clear_free(kinv);
+    BN_clear_free(rp);
+    OPENSSL_cleanse(dgst, sizeof(dgst));
+    return ret;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2022 The OpenSSL Project Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Built-in server side table of external PSKs, consulted before the PSK
+ * callbacks for both the TLSv1.2 PSK ciphersuites and the TLSv1.3
+ * pre_shared_key extension. A table is filled in by the application and then
+ * installed in an SSL_CTX in one step, so handshakes only ever see complete
+ * tables.
+ */
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <openssl/err.h>
+#include "ssl_local.h"
+
+struct ssl_psk_store_entry_st {
+    unsigned char *identity;
+    size_t identity_len;
+    unsigned char *psk;
+    size_t psk_len;
+    /* Ciphersuite the PSK may be used with, or NULL for any */
+    const SSL_CIPHER *cipher;
+    uint32_t hash;
+};
+
+#define PSK_STORE_MIN_SLOTS     16
+
+static uint32_t psk_store_hash(const SSL_PSK_STORE *store,
+                               const unsigned char *identity, size_t len)
+{
+    uint32_t h = 2166136261U ^ store->seed;
+    size_t i;
+
+    /* FNV-1a, seeded per table to make collisions hard to choose */
+    for (i = 0; i < len; i++)
+        h = (h ^ identity[i]) * 16777619U;
+    return h;
+}
+
+static void psk_store_entry_free(SSL_PSK_STORE_ENTRY *ent)
+{
+    if (ent == NULL)
+        return;
+    OPENSSL_free(ent->identity);
+    OPENSSL_clear_free(ent->psk, ent->psk_len);
+    OPENSSL_free(ent);
+}
+
+/*
+ * Returns the slot holding |identity|, or the empty slot where it would be
+ * inserted. There is always at least one empty slot.
+ */
+static SSL_PSK_STORE_ENTRY **psk_store_slot(const SSL_PSK_STORE *store,
+                                            const unsigned char *identity,
+                                            size_t len, uint32_t hash)
+{
+    size_t i = hash & store->mask;
+    SSL_PSK_STORE_ENTRY *ent;
+
+    for (;; i = (i + 1) & store->mask) {
+        ent = store->slots[i];
+        if (ent == NULL
+                || (ent->hash == hash && ent->identity_len == len
+                    && memcmp(ent->identity, identity, len) == 0))
+            return &store->slots[i];
+    }
+}
+
+static int psk_store_resize(SSL_PSK_STORE *store, size_t nslots)
+{
+    SSL_PSK_STORE_ENTRY **old = store->slots;
+    size_t i, oldslots = store->mask + 1;
+
+    store->slots = OPENSSL_zalloc(nslots * sizeof(*store->slots));
+    if (store->slots == NULL) {
+        store->slots = old;
+        ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    store->mask = nslots - 1;
+    for (i = 0; old != NULL && i < oldslots; i++) {
+        if (old[i] != NULL)
+            *psk_store_slot(store, old[i]->identity, old[i]->identity_len,
+                            old[i]->hash) = old[i];
+    }
+    OPENSSL_free(old);
+    return 1;
+}
+
+/*
+ * Creates an empty table, sized so that |expected| identities can be added
+ * without rehashing.
+ */
+SSL_PSK_STORE *SSL_PSK_STORE_new(size_t expected)
+{
+    SSL_PSK_STORE *store = OPENSSL_zalloc(sizeof(*store));
+    size_t nslots = PSK_STORE_MIN_SLOTS;
+
+    if (store == NULL) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+        return NULL;
+    }
+    /* Keep the load factor at or below 3/4 */
+    while (nslots / 4 * 3 < expected && nslots < SIZE_MAX / 2)
+        nslots <<= 1;
+    if (RAND_bytes((unsigned char *)&store->seed, sizeof(store->seed)) <= 0
+            || !psk_store_resize(store, nslots)) {
+        SSL_PSK_STORE_free(store);
+        return NULL;
+    }
+    return store;
+}
+
+void SSL_PSK_STORE_free(SSL_PSK_STORE *store)
+{
+    size_t i;
+
+    if (store == NULL)
+        return;
+    for (i = 0; store->slots != NULL && i <= store->mask; i++)
+        psk_store_entry_free(store->slots[i]);
+    OPENSSL_free(store->slots);
+    OPENSSL_free(store);
+}
+
+/*
+ * Adds |psk| for |identity| to |store|, replacing any PSK already held for
+ * it. If |cipher| is not NULL the PSK is only accepted in handshakes which
+ * negotiate that ciphersuite. Must not be called once |store| is installed.
+ */
+int SSL_PSK_STORE_add(SSL_PSK_STORE *store, const unsigned char *identity,
+                      size_t identity_len, const unsigned char *psk,
+                      size_t psk_len, const SSL_CIPHER *cipher)
+{
+    SSL_PSK_STORE_ENTRY *ent, **slot;
+    uint32_t hash;
+
+    if (identity_len == 0 || identity_len > PSK_MAX_IDENTITY_LEN
+            || psk_len == 0 || psk_len > PSK_MAX_PSK_LEN) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_PASSED_INVALID_ARGUMENT);
+        return 0;
+    }
+    if ((store->num + 1) > (store->mask + 1) / 4 * 3
+            && !psk_store_resize(store, (store->mask + 1) * 2))
+        return 0;
+
+    if ((ent = OPENSSL_zalloc(sizeof(*ent))) == NULL
+            || (ent->identity = OPENSSL_memdup(identity, identity_len)) == NULL
+            || (ent->psk = OPENSSL_memdup(psk, psk_len)) == NULL) {
+        psk_store_entry_free(ent);
+        ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    ent->identity_len = identity_len;
+    ent->psk_len = psk_len;
+    ent->cipher = cipher;
+    ent->hash = hash = psk_store_hash(store, identity, identity_len);
+
+    slot = psk_store_slot(store, identity, identity_len, hash);
+    if (*slot == NULL)
+        store->num++;
+    else
+        psk_store_entry_free(*slot);
+    *slot = ent;
+    return 1;
+}
+
+/*
+ * Installs |store| in |ctx|, replacing and freeing the previous table. The
+ * swap is atomic with respect to handshakes in progress. |ctx| takes
+ * ownership of |store|, which may be NULL to remove the table.
+ */
+int SSL_CTX_set0_psk_store(SSL_CTX *ctx, SSL_PSK_STORE *store)
+{
+    SSL_PSK_STORE *old;
+
+    if (!CRYPTO_THREAD_write_lock(ctx->psk_store_lock))
+        return 0;
+    old = ctx->psk_store;
+    ctx->psk_store = store;
+    CRYPTO_THREAD_unlock(ctx->psk_store_lock);
+
+    SSL_PSK_STORE_free(old);
+    return 1;
+}
+
+/*
+ * Looks |identity| up in the table of the SSL_CTX of |s|. On success the PSK
+ * is copied to |psk|, which must hold PSK_MAX_PSK_LEN bytes, and 1 is
+ * returned. Returns 0 if there is no table or the identity is not in it.
+ */
+int ssl_psk_store_find(SSL *s, const unsigned char *identity,
+                       size_t identity_len, unsigned char *psk,
+                       size_t *psk_len, const SSL_CIPHER **cipher)
+{
+    SSL_PSK_STORE *store;
+    SSL_PSK_STORE_ENTRY *ent;
+    int ret = 0;
+
+    /* Cheap unlocked check for the common case of no table at all */
+    if (s->ctx->psk_store == NULL
+            || !CRYPTO_THREAD_read_lock(s->ctx->psk_store_lock))
+        return 0;
+    store = s->ctx->psk_store;
+    if (store != NULL) {
+        ent = *psk_store_slot(store, identity, identity_len,
+                              psk_store_hash(store, identity, identity_len));
+        if (ent != NULL) {
+            memcpy(psk, ent->psk, ent->psk_len);
+            *psk_len = ent->psk_len;
+            *cipher = ent->cipher;
+            ret = 1;
+        }
+    }
+    CRYPTO_THREAD_unlock(s->ctx->psk_store_lock);
+    return ret;
+}
+
+/*
+ * TLSv1.3 lookup: sets |*sess| to a new session for the PSK held for
+ * |identity|, or to NULL if there is none usable with TLSv1.3. Returns 0 on
+ * internal error.
+ */
+int ssl_psk_store_find_session(SSL *s, const unsigned char *identity,
+                               size_t identity_len, SSL_SESSION **sess)
+{
+    static const unsigned char tls13_aes128gcmsha256_id[] = { 0x13, 0x01 };
+    unsigned char psk[PSK_MAX_PSK_LEN];
+    size_t psk_len;
+    const SSL_CIPHER *cipher;
+
+    *sess = NULL;
+    if (!ssl_psk_store_find(s, identity, identity_len, psk, &psk_len,
+                            &cipher))
+        return 1;
+
+    /* As for the old style callback, default to SHA256 */
+    if (cipher == NULL)
+        cipher = SSL_CIPHER_find(s, tls13_aes128gcmsha256_id);
+    else if (cipher->min_tls < TLS1_3_VERSION)
+        cipher = NULL;
+    if (cipher == NULL) {
+        OPENSSL_cleanse(psk, psk_len);
+        return 1;
+    }
+
+    *sess = SSL_SESSION_new();
+    if (*sess == NULL
+            || !SSL_SESSION_set1_master_key(*sess, psk, psk_len)
+            || !SSL_SESSION_set_cipher(*sess, cipher)
+            || !SSL_SESSION_set_protocol_version(*sess, TLS1_3_VERSION)) {
+        OPENSSL_cleanse(psk, psk_len);
+        SSL_SESSION_free(*sess);
+        *sess = NULL;
+        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+    OPENSSL_cleanse(psk, psk_len);
+    return 1;
+}
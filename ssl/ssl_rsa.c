@@ -131,6 +131,7 @@ static int ssl_set_pkey(CERT *c, EVP_PKEY *pkey)
     EVP_PKEY_free(c->pkeys[i].privatekey);
     EVP_PKEY_up_ref(pkey);
     c->pkeys[i].privatekey = pkey;
+    ssl_cert_pkey_set_static_flags(&c->pkeys[i]);
     c->key = &c->pkeys[i];
     return 1;
 }
@@ -269,6 +270,7 @@ static int ssl_set_cert(CERT *c, X509 *x)
     X509_free(c->pkeys[i].x509);
     X509_up_ref(x);
     c->pkeys[i].x509 = x;
+    ssl_cert_pkey_set_static_flags(&c->pkeys[i]);
     c->key = &(c->pkeys[i]);
 
     return 1;
@@ -1009,6 +1011,7 @@ static int ssl_set_cert_and_key(SSL *ssl, SSL_CTX *ctx, X509 *x509, EVP_PKEY *pr
     EVP_PKEY_free(c->pkeys[i].privatekey);
     EVP_PKEY_up_ref(privatekey);
     c->pkeys[i].privatekey = privatekey;
+    ssl_cert_pkey_set_static_flags(&c->pkeys[i]);
 
     c->key = &(c->pkeys[i]);
 
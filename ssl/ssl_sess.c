@@ -187,6 +187,8 @@ SSL_SESSION *ssl_session_dup(const SSL_SESSION *src, int ticket)
 #endif
     dest->peer_chain = NULL;
     dest->peer = NULL;
+    /* The copy holds its own references, outside the pool */
+    dest->peer_pool = NULL;
     dest->ticket_appdata = NULL;
     memset(&dest->ex_data, 0, sizeof(dest->ex_data));
 
@@ -481,6 +483,155 @@ int ssl_get_new_session(SSL *s, int session)
     return 1;
 }
 
+/*
+ * Asynchronous lookups in the external session cache. Instead of calling
+ * the get_session_cb, which blocks the thread for as long as the external
+ * store takes, the handshake records the session ID it wants and suspends
+ * with SSL_ERROR_WANT_SESSION_LOOKUP. The application gathers the IDs of
+ * the waiting connections, fetches their sessions in one request, hands
+ * each result to its connection and resumes the handshakes, which then
+ * process the ClientHello again. The results are kept until the processing
+ * of the ClientHello finishes, so a ClientHello offering several IDs (e.g.
+ * TLSv1.3 PSK identities) needs at most SSL_SESS_LOOKUP_MAX suspensions.
+ */
+
+void SSL_CTX_set_async_session_lookup(SSL_CTX *ctx, int onoff)
+{
+    ctx->async_session_lookup = onoff != 0;
+}
+
+/* Forgets the lookups done for the ClientHello, once it is processed */
+void ssl_sess_lookup_clear(SSL *s)
+{
+    size_t i;
+
+    for (i = 0; i < s->sess_lookup.nresults; i++)
+        SSL_SESSION_free(s->sess_lookup.results[i].sess);
+    s->sess_lookup.nresults = 0;
+    s->sess_lookup.id_len = 0;
+    s->sess_lookup.state = SSL_SESS_LOOKUP_NONE;
+}
+
+/*
+ * Returns the session ID that |s| waits for, and its length in |*len|, or
+ * NULL if |s| is not waiting for a session lookup.
+ */
+const unsigned char *SSL_get0_session_lookup_id(const SSL *s, size_t *len)
+{
+    if (s->sess_lookup.state != SSL_SESS_LOOKUP_PENDING)
+        return NULL;
+    *len = s->sess_lookup.id_len;
+    return s->sess_lookup.id;
+}
+
+/*
+ * Supplies the result of the lookup that |s| waits for: the session found,
+ * of which |s| takes a reference, or NULL if there was none.
+ */
+int SSL_set1_session_lookup_result(SSL *s, SSL_SESSION *sess)
+{
+    SSL_SESS_LOOKUP_RESULT *res;
+
+    if (s->sess_lookup.state != SSL_SESS_LOOKUP_PENDING
+            || !ossl_assert(s->sess_lookup.nresults < SSL_SESS_LOOKUP_MAX)) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_SHOULD_NOT_HAVE_BEEN_CALLED);
+        return 0;
+    }
+    if (sess != NULL && !SSL_SESSION_up_ref(sess))
+        return 0;
+    res = &s->sess_lookup.results[s->sess_lookup.nresults++];
+    memcpy(res->id, s->sess_lookup.id, s->sess_lookup.id_len);
+    res->id_len = s->sess_lookup.id_len;
+    res->sess = sess;
+    s->sess_lookup.state = SSL_SESS_LOOKUP_READY;
+    return 1;
+}
+
+/*
+ * Looks up the sessions that the connections among |ssls| wait for with a
+ * single call of |cb|. It gets their |n| IDs and stores in |sessions| the
+ * session found for each, passing its reference over, or NULL. Returns the
+ * number of connections that got a result and can resume their handshakes.
+ */
+size_t SSL_lookup_sessions(SSL **ssls, size_t n,
+                           SSL_multi_get_session_cb_func cb, void *arg)
+{
+    const unsigned char **ids;
+    size_t *lens;
+    SSL_SESSION **sessions;
+    SSL **waiting;
+    size_t i, nwaiting = 0, done = 0;
+
+    if (n == 0)
+        return 0;
+    ids = OPENSSL_malloc(n * sizeof(*ids));
+    lens = OPENSSL_malloc(n * sizeof(*lens));
+    sessions = OPENSSL_zalloc(n * sizeof(*sessions));
+    waiting = OPENSSL_malloc(n * sizeof(*waiting));
+    if (ids == NULL || lens == NULL || sessions == NULL || waiting == NULL) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+        goto end;
+    }
+
+    for (i = 0; i < n; i++) {
+        if ((ids[nwaiting] = SSL_get0_session_lookup_id(ssls[i],
+                                                        &lens[nwaiting]))
+                != NULL)
+            waiting[nwaiting++] = ssls[i];
+    }
+    if (nwaiting == 0 || !cb(ids, lens, nwaiting, sessions, arg))
+        goto end;
+
+    for (i = 0; i < nwaiting; i++) {
+        if (SSL_set1_session_lookup_result(waiting[i], sessions[i]))
+            done++;
+    }
+
+ end:
+    if (sessions != NULL) {
+        for (i = 0; i < nwaiting; i++)
+            SSL_SESSION_free(sessions[i]);
+    }
+    OPENSSL_free(ids);
+    OPENSSL_free(lens);
+    OPENSSL_free(sessions);
+    OPENSSL_free(waiting);
+    return done;
+}
+
+/*
+ * Returns the session supplied for |sess_id| if |s| looked it up for this
+ * ClientHello, or starts a lookup of it. Each ID is looked up at most once
+ * per ClientHello, so that processing it again always makes progress. Only
+ * one lookup is pending at a time, and no more than SSL_SESS_LOOKUP_MAX are
+ * done; the other IDs are treated as misses.
+ */
+static SSL_SESSION *sess_lookup_get(SSL *s, const unsigned char *sess_id,
+                                    size_t sess_id_len)
+{
+    SSL_SESS_LOOKUP_RESULT *res;
+    size_t i;
+
+    if (sess_id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+
+    for (i = 0; i < s->sess_lookup.nresults; i++) {
+        res = &s->sess_lookup.results[i];
+        if (res->id_len == sess_id_len
+                && memcmp(res->id, sess_id, sess_id_len) == 0)
+            return res->sess;
+    }
+
+    if (s->sess_lookup.state == SSL_SESS_LOOKUP_PENDING
+            || s->sess_lookup.nresults == SSL_SESS_LOOKUP_MAX)
+        return NULL;
+
+    memcpy(s->sess_lookup.id, sess_id, sess_id_len);
+    s->sess_lookup.id_len = sess_id_len;
+    s->sess_lookup.state = SSL_SESS_LOOKUP_PENDING;
+    return NULL;
+}
+
 SSL_SESSION *lookup_sess_in_cache(SSL *s, const unsigned char *sess_id,
                                   size_t sess_id_len)
 {
@@ -509,10 +660,24 @@ SSL_SESSION *lookup_sess_in_cache(SSL *s, const unsigned char *sess_id,
             ssl_tsan_counter(s->session_ctx, &s->session_ctx->stats.sess_miss);
     }
 
-    if (ret == NULL && s->session_ctx->get_session_cb != NULL) {
+    /*
+     * Sessions found in the shared cache are not added to the internal one:
+     * that would write them straight back to the shared cache.
+     */
+    if (ret == NULL && s->session_ctx->shm_sess_cache != NULL)
+        ret = ssl_shm_sess_get(s, sess_id, sess_id_len);
+
+    if (ret == NULL && (s->session_ctx->async_session_lookup
+                        || s->session_ctx->get_session_cb != NULL)) {
         int copy = 1;
 
-        ret = s->session_ctx->get_session_cb(s, sess_id, sess_id_len, &copy);
+        if (s->session_ctx->async_session_lookup) {
+            /* A supplied session stays available to later passes */
+            ret = sess_lookup_get(s, sess_id, sess_id_len);
+        } else {
+            ret = s->session_ctx->get_session_cb(s, sess_id, sess_id_len,
+                                                 &copy);
+        }
 
         if (ret != NULL) {
             ssl_tsan_counter(s->session_ctx,
@@ -704,6 +869,10 @@ int SSL_CTX_add_session(SSL_CTX *ctx, SSL_SESSION *c)
     int ret = 0;
     SSL_SESSION *s;
 
+    /* The shared cache holds copies, so it doesn't need the lock below */
+    if (ctx->shm_sess_cache != NULL)
+        (void)ssl_shm_sess_add(ctx, c);
+
     /*
      * add just 1 reference count for the SSL_CTX's session cache even though
      * it has two ways of access: each session is in a doubly linked list and
@@ -788,6 +957,12 @@ int SSL_CTX_add_session(SSL_CTX *ctx, SSL_SESSION *c)
 
 int SSL_CTX_remove_session(SSL_CTX *ctx, SSL_SESSION *c)
 {
+    /*
+     * Only explicit removals reach the shared cache, sessions evicted from
+     * the internal cache of this process may still be in use by others.
+     */
+    if (ctx->shm_sess_cache != NULL && c != NULL)
+        ssl_shm_sess_remove(ctx, c);
     return remove_session_lock(ctx, c, 1);
 }
 
@@ -836,6 +1011,7 @@ void SSL_SESSION_free(SSL_SESSION *ss)
 
     OPENSSL_cleanse(ss->master_key, sizeof(ss->master_key));
     OPENSSL_cleanse(ss->session_id, sizeof(ss->session_id));
+    ssl_peer_pool_release(ss);
     X509_free(ss->peer);
     sk_X509_pop_free(ss->peer_chain, X509_free);
     OPENSSL_free(ss->ext.hostname);
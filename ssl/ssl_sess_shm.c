@@ -0,0 +1,358 @@
+/*
+ * Copyright 2022 The OpenSSL Project Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Server session cache in a memory region shared between processes, e.g. an
+ * anonymous shared mapping created before the workers of a prefork server
+ * are forked. The application owns the region, this file only defines its
+ * layout:
+ *
+ *   header | bucket 0 | bucket 1 | ...
+ *
+ * Each bucket is a spinlock on its own cache line followed by
+ * SHM_SESS_WAYS fixed size slots, each holding one DER encoded session.
+ * A session ID hashes to a single bucket, within which the least recently
+ * used or an expired slot is replaced, so all operations lock one bucket.
+ */
+
+#include <time.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include "ssl_local.h"
+
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+# define SHM_SESS_HAVE_ATOMICS
+#endif
+
+#define SHM_SESS_MAGIC      0x53534d31U
+#define SHM_SESS_WAYS       8
+#define SHM_SESS_ALIGN      64
+/* The critical sections only copy one slot, so this is far longer */
+#define SHM_SESS_LOCK_SPINS 1024
+
+#if defined(__i386__) || defined(__x86_64__)
+# define SHM_SESS_PAUSE()   __builtin_ia32_pause()
+#elif defined(__aarch64__)
+# define SHM_SESS_PAUSE()   __asm__ __volatile__("yield" ::: "memory")
+#else
+# define SHM_SESS_PAUSE()   __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+typedef struct {
+    uint32_t magic;
+    uint32_t nbuckets;
+    uint32_t max_der_len;
+    uint32_t slot_size;
+} SHM_SESS_HEADER;
+
+typedef struct {
+    uint32_t lock;
+    uint32_t pad;
+    /* Bumped on every access, orders the slots for LRU replacement */
+    uint64_t tick;
+} SHM_SESS_BUCKET;
+
+typedef struct {
+    uint64_t expire;
+    uint64_t used;
+    /* Length of the DER encoding which follows, 0 if the slot is free */
+    uint32_t der_len;
+    uint32_t sid_len;
+    unsigned char sid[SSL_MAX_SSL_SESSION_ID_LENGTH];
+} SHM_SESS_SLOT;
+
+#define SHM_SESS_ROUND(n) \
+    (((n) + SHM_SESS_ALIGN - 1) & ~(size_t)(SHM_SESS_ALIGN - 1))
+
+static size_t shm_sess_slot_size(size_t max_der_len)
+{
+    return SHM_SESS_ROUND(sizeof(SHM_SESS_SLOT) + max_der_len);
+}
+
+static size_t shm_sess_bucket_size(size_t slot_size)
+{
+    return SHM_SESS_ROUND(sizeof(SHM_SESS_BUCKET)) + SHM_SESS_WAYS * slot_size;
+}
+
+/*
+ * Returns the number of bytes needed for a region holding |nsessions|
+ * sessions of up to |max_der_len| bytes when DER encoded.
+ */
+size_t SSL_shm_session_cache_size(size_t nsessions, size_t max_der_len)
+{
+    size_t nbuckets = (nsessions + SHM_SESS_WAYS - 1) / SHM_SESS_WAYS;
+
+    return SHM_SESS_ROUND(sizeof(SHM_SESS_HEADER))
+           + nbuckets * shm_sess_bucket_size(shm_sess_slot_size(max_der_len));
+}
+
+/*
+ * Formats the |len| bytes at |mem| as an empty session cache. Must be done
+ * once, before any process attaches it with SSL_CTX_set_shm_session_cache().
+ * |mem| must be aligned to at least 8 bytes.
+ */
+int SSL_shm_session_cache_init(void *mem, size_t len, size_t max_der_len)
+{
+#ifdef SHM_SESS_HAVE_ATOMICS
+    SHM_SESS_HEADER *hdr = mem;
+    size_t slot_size = shm_sess_slot_size(max_der_len);
+    size_t nbuckets;
+
+    if (mem == NULL || max_der_len == 0 || max_der_len > UINT32_MAX / 2
+            || len < SHM_SESS_ROUND(sizeof(*hdr))) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_PASSED_INVALID_ARGUMENT);
+        return 0;
+    }
+    nbuckets = (len - SHM_SESS_ROUND(sizeof(*hdr)))
+               / shm_sess_bucket_size(slot_size);
+    if (nbuckets == 0 || nbuckets > UINT32_MAX) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_PASSED_INVALID_ARGUMENT);
+        return 0;
+    }
+
+    memset(mem, 0, len);
+    hdr->nbuckets = (uint32_t)nbuckets;
+    hdr->max_der_len = (uint32_t)max_der_len;
+    hdr->slot_size = (uint32_t)slot_size;
+    __atomic_store_n(&hdr->magic, SHM_SESS_MAGIC, __ATOMIC_RELEASE);
+    return 1;
+#else
+    ERR_raise(ERR_LIB_SSL, ERR_R_UNSUPPORTED);
+    return 0;
+#endif
+}
+
+/*
+ * Makes |ctx| use the session cache at |mem|, formatted earlier with
+ * SSL_shm_session_cache_init(), in addition to its internal cache. NULL
+ * detaches the current one.
+ */
+int SSL_CTX_set_shm_session_cache(SSL_CTX *ctx, void *mem)
+{
+    SHM_SESS_HEADER *hdr = mem;
+
+    if (hdr != NULL && hdr->magic != SHM_SESS_MAGIC) {
+        ERR_raise(ERR_LIB_SSL, ERR_R_PASSED_INVALID_ARGUMENT);
+        return 0;
+    }
+    ctx->shm_sess_cache = mem;
+    return 1;
+}
+
+#ifdef SHM_SESS_HAVE_ATOMICS
+
+static SHM_SESS_BUCKET *shm_sess_bucket(SHM_SESS_HEADER *hdr,
+                                        const unsigned char *sid,
+                                        size_t sid_len)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    /* Server generated IDs are random, but clients choose what they send */
+    for (i = 0; i < sid_len; i++)
+        h = (h ^ sid[i]) * 16777619U;
+    return (SHM_SESS_BUCKET *)((unsigned char *)hdr
+                               + SHM_SESS_ROUND(sizeof(*hdr))
+                               + (h % hdr->nbuckets)
+                                 * shm_sess_bucket_size(hdr->slot_size));
+}
+
+static SHM_SESS_SLOT *shm_sess_slot(SHM_SESS_HEADER *hdr, SHM_SESS_BUCKET *b,
+                                    size_t i)
+{
+    return (SHM_SESS_SLOT *)((unsigned char *)b
+                             + SHM_SESS_ROUND(sizeof(*b))
+                             + i * hdr->slot_size);
+}
+
+/*
+ * Locks |b|, giving up after SHM_SESS_LOCK_SPINS attempts: a worker that dies
+ * while holding the lock must not hang every other process. Returns 1 if
+ * the lock is held, or 0 if the caller must treat the bucket as a miss.
+ */
+static int shm_sess_lock(SHM_SESS_BUCKET *b)
+{
+    unsigned int spins = 0;
+
+    while (__atomic_exchange_n(&b->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        do {
+            if (++spins == SHM_SESS_LOCK_SPINS)
+                return 0;
+            SHM_SESS_PAUSE();
+        } while (__atomic_load_n(&b->lock, __ATOMIC_RELAXED) != 0);
+    }
+    return 1;
+}
+
+static void shm_sess_unlock(SHM_SESS_BUCKET *b)
+{
+    __atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void shm_sess_slot_clear(SHM_SESS_SLOT *slot)
+{
+    OPENSSL_cleanse(slot + 1, slot->der_len);
+    slot->der_len = 0;
+}
+
+/* Returns the slot holding |sid|, or NULL. Called with the bucket locked. */
+static SHM_SESS_SLOT *shm_sess_find(SHM_SESS_HEADER *hdr, SHM_SESS_BUCKET *b,
+                                    const unsigned char *sid, size_t sid_len)
+{
+    SHM_SESS_SLOT *slot;
+    size_t i;
+
+    for (i = 0; i < SHM_SESS_WAYS; i++) {
+        slot = shm_sess_slot(hdr, b, i);
+        if (slot->der_len != 0 && slot->sid_len == sid_len
+                && memcmp(slot->sid, sid, sid_len) == 0)
+            return slot;
+    }
+    return NULL;
+}
+
+/*
+ * Stores |sess| in the shared cache of |ctx|. Sessions whose encoding does
+ * not fit in a slot are not stored. Returns 1 if |sess| was stored.
+ */
+int ssl_shm_sess_add(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    SHM_SESS_HEADER *hdr = ctx->shm_sess_cache;
+    SHM_SESS_BUCKET *b;
+    SHM_SESS_SLOT *slot, *cand;
+    unsigned char *der = NULL;
+    uint64_t now = (uint64_t)time(NULL);
+    int der_len;
+    size_t i;
+
+    if (sess->session_id_length == 0 || sess->not_resumable)
+        return 0;
+    der_len = i2d_SSL_SESSION(sess, &der);
+    if (der_len <= 0 || (size_t)der_len > hdr->max_der_len) {
+        OPENSSL_clear_free(der, der_len > 0 ? der_len : 0);
+        return 0;
+    }
+
+    b = shm_sess_bucket(hdr, sess->session_id, sess->session_id_length);
+    if (!shm_sess_lock(b)) {
+        OPENSSL_clear_free(der, der_len);
+        return 0;
+    }
+    slot = shm_sess_find(hdr, b, sess->session_id, sess->session_id_length);
+    for (i = 0; slot == NULL && i < SHM_SESS_WAYS; i++) {
+        cand = shm_sess_slot(hdr, b, i);
+        if (cand->der_len == 0 || cand->expire <= now) {
+            slot = cand;
+            break;
+        }
+    }
+    for (i = 0; slot == NULL && i < SHM_SESS_WAYS; i++) {
+        cand = shm_sess_slot(hdr, b, i);
+        if (i == 0 || cand->used < slot->used)
+            slot = cand;
+    }
+    if (slot == NULL) {
+        /* Unreachable, the loop above always picks a slot */
+        shm_sess_unlock(b);
+        OPENSSL_clear_free(der, der_len);
+        return 0;
+    }
+    shm_sess_slot_clear(slot);
+    memcpy(slot + 1, der, der_len);
+    memcpy(slot->sid, sess->session_id, sess->session_id_length);
+    slot->sid_len = (uint32_t)sess->session_id_length;
+    slot->expire = sess->timeout_ovf ? UINT64_MAX
+                                     : (uint64_t)sess->calc_timeout;
+    slot->used = ++b->tick;
+    slot->der_len = (uint32_t)der_len;
+    shm_sess_unlock(b);
+
+    OPENSSL_clear_free(der, der_len);
+    return 1;
+}
+
+/* Returns a new session for |sid| from the shared cache of |s|, or NULL */
+SSL_SESSION *ssl_shm_sess_get(SSL *s, const unsigned char *sid,
+                              size_t sid_len)
+{
+    SHM_SESS_HEADER *hdr = s->session_ctx->shm_sess_cache;
+    SHM_SESS_BUCKET *b;
+    SHM_SESS_SLOT *slot;
+    SSL_SESSION *ret = NULL;
+    unsigned char *der = NULL;
+    const unsigned char *p;
+    size_t der_len = 0;
+
+    if (sid_len == 0 || sid_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+
+    b = shm_sess_bucket(hdr, sid, sid_len);
+    if (!shm_sess_lock(b))
+        return NULL;
+    slot = shm_sess_find(hdr, b, sid, sid_len);
+    if (slot != NULL && slot->expire <= (uint64_t)time(NULL)) {
+        shm_sess_slot_clear(slot);
+        slot = NULL;
+    }
+    if (slot != NULL && (der = OPENSSL_malloc(slot->der_len)) != NULL) {
+        der_len = slot->der_len;
+        memcpy(der, slot + 1, der_len);
+        slot->used = ++b->tick;
+    }
+    shm_sess_unlock(b);
+
+    if (der == NULL)
+        return NULL;
+    p = der;
+    ret = d2i_SSL_SESSION(NULL, &p, (long)der_len);
+    OPENSSL_clear_free(der, der_len);
+    if (ret != NULL && ret->ssl_version != s->version) {
+        SSL_SESSION_free(ret);
+        ret = NULL;
+    }
+    return ret;
+}
+
+/* Removes |sess| from the shared cache of |ctx|, in every process */
+void ssl_shm_sess_remove(SSL_CTX *ctx, const SSL_SESSION *sess)
+{
+    SHM_SESS_HEADER *hdr = ctx->shm_sess_cache;
+    SHM_SESS_BUCKET *b;
+    SHM_SESS_SLOT *slot;
+
+    if (sess->session_id_length == 0)
+        return;
+    b = shm_sess_bucket(hdr, sess->session_id, sess->session_id_length);
+    if (!shm_sess_lock(b))
+        return;
+    slot = shm_sess_find(hdr, b, sess->session_id, sess->session_id_length);
+    if (slot != NULL)
+        shm_sess_slot_clear(slot);
+    shm_sess_unlock(b);
+}
+
+#else
+
+/* Without atomics a region can't be formatted, so these are never reached */
+int ssl_shm_sess_add(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    return 0;
+}
+
+SSL_SESSION *ssl_shm_sess_get(SSL *s, const unsigned char *sid,
+                              size_t sid_len)
+{
+    return NULL;
+}
+
+void ssl_shm_sess_remove(SSL_CTX *ctx, const SSL_SESSION *sess)
+{
+}
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Copyright 2022 The OpenSSL Project Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").  You may not use
+ * this file except in compliance with the License.  You can obtain a copy
+ * in the file LICENSE in the source distribution or at
+ * https://www.openssl.org/source/license.html
+ */
+
+/*
+ * Server side OCSP stapling cache. The SSL_CTX keeps the current response
+ * for each of its certificates and every handshake takes a reference to it
+ * rather than a copy. Fresh responses are requested from an application
+ * supplied fetcher, which delivers them asynchronously, so handshakes never
+ * wait for a responder.
+ */
+
+#include <time.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include "internal/refcount.h"
+#include "ssl_local.h"
+
+/* Seconds after which a fetch that delivered nothing is requested again */
+#define SSL_OCSP_FETCH_TIMEOUT  60
+
+void ssl_ocsp_staple_free(SSL_OCSP_STAPLE *staple)
+{
+    int i;
+
+    if (staple == NULL)
+        return;
+    CRYPTO_DOWN_REF(&staple->references, &i, staple->lock);
+    REF_PRINT_COUNT("SSL_OCSP_STAPLE", staple);
+    if (i > 0)
+        return;
+    REF_ASSERT_ISNT(i < 0);
+
+    OPENSSL_free(staple->resp);
+    CRYPTO_THREAD_lock_free(staple->lock);
+    OPENSSL_free(staple);
+}
+
+void ssl_ocsp_cache_free(SSL_CTX *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < SSL_PKEY_NUM; i++) {
+        X509_free(ctx->ext.ocsp_cache[i].x509);
+        ssl_ocsp_staple_free(ctx->ext.ocsp_cache[i].staple);
+    }
+    CRYPTO_THREAD_lock_free(ctx->ext.ocsp_cache_lock);
+}
+
+/*
+ * Points |slot| at |x| if it was for another certificate, dropping the
+ * response cached for that one. Must be called with the write lock held.
+ */
+static void ssl_ocsp_cache_set_cert(SSL_OCSP_CACHE *slot, X509 *x)
+{
+    if (slot->x509 == x)
+        return;
+    X509_up_ref(x);
+    X509_free(slot->x509);
+    slot->x509 = x;
+    ssl_ocsp_staple_free(slot->staple);
+    slot->staple = NULL;
+    slot->fetch_started = 0;
+}
+
+/*
+ * Returns 1 if a fetch for |slot| is pending. A fetcher that lost the
+ * request must not stop the refreshes, so a fetch expires after a while.
+ */
+static int ssl_ocsp_cache_fetching(const SSL_OCSP_CACHE *slot, time_t now)
+{
+    return slot->fetch_started != 0
+           && now - slot->fetch_started < SSL_OCSP_FETCH_TIMEOUT;
+}
+
+/*
+ * Looks up the cached response for the certificate selected for |s| and, if
+ * there is a current one, arranges for |s| to staple it. Asks the fetcher
+ * for a new response when the cached one is missing or due for a refresh.
+ * Returns 1 if a response will be stapled, 0 otherwise.
+ */
+int ssl_ocsp_cache_get(SSL *s)
+{
+    SSL_CTX *ctx = s->ctx;
+    X509 *x = s->s3.tmp.cert->x509;
+    SSL_OCSP_CACHE *slot;
+    SSL_OCSP_STAPLE *staple = NULL;
+    time_t now = time(NULL);
+    int fetch, i;
+
+    if (x == NULL
+            || !CRYPTO_THREAD_read_lock(ctx->ext.ocsp_cache_lock))
+        return 0;
+    slot = &ctx->ext.ocsp_cache[s->s3.tmp.cert - s->cert->pkeys];
+    if (slot->x509 == x && slot->staple != NULL) {
+        staple = slot->staple;
+        CRYPTO_UP_REF(&staple->references, &i, staple->lock);
+    }
+    fetch = ctx->ext.ocsp_fetch_cb != NULL
+            && (slot->x509 != x || !ssl_ocsp_cache_fetching(slot, now))
+            && (staple == NULL || now >= staple->refresh_at);
+    CRYPTO_THREAD_unlock(ctx->ext.ocsp_cache_lock);
+
+    if (fetch && CRYPTO_THREAD_write_lock(ctx->ext.ocsp_cache_lock)) {
+        /* Only one handshake gets to request the fetch */
+        ssl_ocsp_cache_set_cert(slot, x);
+        fetch = !ssl_ocsp_cache_fetching(slot, now);
+        if (fetch)
+            slot->fetch_started = now;
+        CRYPTO_THREAD_unlock(ctx->ext.ocsp_cache_lock);
+
+        if (fetch && !ctx->ext.ocsp_fetch_cb(ctx, x, ctx->ext.ocsp_fetch_arg)
+                && CRYPTO_THREAD_write_lock(ctx->ext.ocsp_cache_lock)) {
+            /* Let a later handshake try again */
+            if (slot->x509 == x)
+                slot->fetch_started = 0;
+            CRYPTO_THREAD_unlock(ctx->ext.ocsp_cache_lock);
+        }
+    }
+
+    if (staple != NULL && staple->expire_at != 0 && now >= staple->expire_at) {
+        ssl_ocsp_staple_free(staple);
+        staple = NULL;
+    }
+    if (staple == NULL)
+        return 0;
+
+    ssl_ocsp_staple_free(s->ext.ocsp.staple);
+    s->ext.ocsp.staple = staple;
+    return 1;
+}
+
+/*
+ * Sets the fetcher asked for new OCSP responses by the stapling cache of
+ * |ctx|. The fetcher is called at most once per certificate until a response,
+ * or its failure, is delivered with SSL_CTX_set1_ocsp_staple(), or until
+ * SSL_OCSP_FETCH_TIMEOUT seconds have passed.
+ */
+void SSL_CTX_set_ocsp_fetch_cb(SSL_CTX *ctx, SSL_ocsp_fetch_cb_func cb,
+                               void *arg)
+{
+    ctx->ext.ocsp_fetch_cb = cb;
+    ctx->ext.ocsp_fetch_arg = arg;
+}
+
+/*
+ * Stores the DER encoded OCSP response |resp| for the certificate |x| of
+ * |ctx|, to be stapled by handshakes using |x|. A new one is requested from
+ * the fetcher from |refresh_at| on, and the response is no longer stapled
+ * from |expire_at| on, unless that is 0. Handshakes which already took the
+ * previous response keep it. A NULL |resp| is how a fetcher reports failure:
+ * the cached response stays in use until it expires, and the next handshake
+ * asks for a new one.
+ */
+int SSL_CTX_set1_ocsp_staple(SSL_CTX *ctx, X509 *x, const unsigned char *resp,
+                             size_t resp_len, time_t refresh_at,
+                             time_t expire_at)
+{
+    SSL_OCSP_STAPLE *staple = NULL, *old = NULL;
+    SSL_OCSP_CACHE *slot;
+    EVP_PKEY *pkey;
+    size_t idx;
+
+    if (x == NULL || (pkey = X509_get0_pubkey(x)) == NULL
+            || ssl_cert_lookup_by_pkey(pkey, &idx) == NULL) {
+        ERR_raise(ERR_LIB_SSL, SSL_R_UNKNOWN_CERTIFICATE_TYPE);
+        return 0;
+    }
+
+    if (resp != NULL) {
+        staple = OPENSSL_zalloc(sizeof(*staple));
+        if (staple == NULL
+                || (staple->resp = OPENSSL_memdup(resp, resp_len)) == NULL
+                || (staple->lock = CRYPTO_THREAD_lock_new()) == NULL) {
+            if (staple != NULL) {
+                OPENSSL_free(staple->resp);
+                OPENSSL_free(staple);
+            }
+            ERR_raise(ERR_LIB_SSL, ERR_R_MALLOC_FAILURE);
+            return 0;
+        }
+        staple->references = 1;
+        staple->resp_len = resp_len;
+        staple->refresh_at = refresh_at;
+        staple->expire_at = expire_at;
+    }
+
+    if (!CRYPTO_THREAD_write_lock(ctx->ext.ocsp_cache_lock)) {
+        ssl_ocsp_staple_free(staple);
+        return 0;
+    }
+    slot = &ctx->ext.ocsp_cache[idx];
+    ssl_ocsp_cache_set_cert(slot, x);
+    if (staple != NULL) {
+        old = slot->staple;
+        slot->staple = staple;
+    }
+    slot->fetch_started = 0;
+    CRYPTO_THREAD_unlock(ctx->ext.ocsp_cache_lock);
+
+    ssl_ocsp_staple_free(old);
+    return 1;
+}
@@ -669,6 +669,7 @@ int tls_parse_ctos_key_share(SSL *s, PACKET *pkt, unsigned int context, X509 *x,
         s->s3.group_id = group_id;
         /* Cache the selected group ID in the SSL_SESSION */
         s->session->kex_group = group_id;
+        ssl_neg_stats_count(s, SSL_NEG_STAT_GROUP, group_id);
 
         if (tls13_set_encoded_pub_key(s->s3.peer_tmp,
                                       PACKET_data(&encoded_pt),
@@ -1023,6 +1024,13 @@ int tls_parse_ctos_psk(SSL *s, PACKET *pkt, unsigned int context, X509 *x,
             return 0;
         }
 
+        if (sess == NULL
+                && !ssl_psk_store_find_session(s, PACKET_data(&identity),
+                                               idlen, &sess)) {
+            /* SSLfatal() already called */
+            return 0;
+        }
+
 #ifndef OPENSSL_NO_PSK
         if(sess == NULL
                 && s->psk_server_callback != NULL
@@ -387,7 +387,8 @@ static int state_machine(SSL *s, int server)
         }
 
         if (s->init_buf == NULL) {
-            if ((buf = BUF_MEM_new()) == NULL) {
+            if ((buf = ssl_conn_res_take_init_buf(s)) == NULL
+                    && (buf = BUF_MEM_new()) == NULL) {
                 SSLfatal(s, SSL_AD_NO_ALERT, ERR_R_INTERNAL_ERROR);
                 goto end;
             }
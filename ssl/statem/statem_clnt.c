@@ -840,7 +840,8 @@ WORK_STATE ossl_statem_client_post_work(SSL *s, WORK_STATE wst)
                      0, NULL);
         }
 #endif
-        if (statem_flush(s) != 1)
+        /* A held Finished leaves with the first application data */
+        if (!ssl_hold_finished(s) && statem_flush(s) != 1)
             return WORK_MORE_B;
 
         if (SSL_IS_TLS13(s)) {
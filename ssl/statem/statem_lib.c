@@ -310,56 +310,64 @@ int tls_construct_cert_verify(SSL *s, WPACKET *pkt)
         goto err;
     }
 
-    if (EVP_DigestSignInit_ex(mctx, &pctx,
-                              md == NULL ? NULL : EVP_MD_get0_name(md),
-                              s->ctx->libctx, s->ctx->propq, pkey,
-                              NULL) <= 0) {
-        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
-        goto err;
-    }
-
-    if (lu->sig == EVP_PKEY_RSA_PSS) {
-        if (EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PSS_PADDING) <= 0
-            || EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx,
-                                                RSA_PSS_SALTLEN_DIGEST) <= 0) {
+    /* Try a precomputed nonce first, see ssl_presign.c */
+    if (s->version == SSL3_VERSION
+            || !ssl_presign_sign(s, lu, pkey, md, hdata, hdatalen, &sig,
+                                 &siglen)) {
+        if (EVP_DigestSignInit_ex(mctx, &pctx,
+                                  md == NULL ? NULL : EVP_MD_get0_name(md),
+                                  s->ctx->libctx, s->ctx->propq, pkey,
+                                  NULL) <= 0) {
             SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
             goto err;
         }
-    }
-    if (s->version == SSL3_VERSION) {
-        /*
-         * Here we use EVP_DigestSignUpdate followed by EVP_DigestSignFinal
-         * in order to add the EVP_CTRL_SSL3_MASTER_SECRET call between them.
-         */
-        if (EVP_DigestSignUpdate(mctx, hdata, hdatalen) <= 0
-            || EVP_MD_CTX_ctrl(mctx, EVP_CTRL_SSL3_MASTER_SECRET,
-                               (int)s->session->master_key_length,
-                               s->session->master_key) <= 0
-            || EVP_DigestSignFinal(mctx, NULL, &siglen) <= 0) {
 
-            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
-            goto err;
-        }
-        sig = OPENSSL_malloc(siglen);
-        if (sig == NULL
-                || EVP_DigestSignFinal(mctx, sig, &siglen) <= 0) {
-            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
-            goto err;
-        }
-    } else {
-        /*
-         * Here we *must* use EVP_DigestSign() because Ed25519/Ed448 does not
-         * support streaming via EVP_DigestSignUpdate/EVP_DigestSignFinal
-         */
-        if (EVP_DigestSign(mctx, NULL, &siglen, hdata, hdatalen) <= 0) {
-            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
-            goto err;
+        if (lu->sig == EVP_PKEY_RSA_PSS) {
+            if (EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PSS_PADDING) <= 0
+                || EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx,
+                                                RSA_PSS_SALTLEN_DIGEST) <= 0) {
+                SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
+                goto err;
+            }
         }
-        sig = OPENSSL_malloc(siglen);
-        if (sig == NULL
-                || EVP_DigestSign(mctx, sig, &siglen, hdata, hdatalen) <= 0) {
-            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
-            goto err;
+        if (s->version == SSL3_VERSION) {
+            /*
+             * Here we use EVP_DigestSignUpdate followed by
+             * EVP_DigestSignFinal in order to add the
+             * EVP_CTRL_SSL3_MASTER_SECRET call between them.
+             */
+            if (EVP_DigestSignUpdate(mctx, hdata, hdatalen) <= 0
+                || EVP_MD_CTX_ctrl(mctx, EVP_CTRL_SSL3_MASTER_SECRET,
+                                   (int)s->session->master_key_length,
+                                   s->session->master_key) <= 0
+                || EVP_DigestSignFinal(mctx, NULL, &siglen) <= 0) {
+
+                SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
+                goto err;
+            }
+            sig = OPENSSL_malloc(siglen);
+            if (sig == NULL
+                    || EVP_DigestSignFinal(mctx, sig, &siglen) <= 0) {
+                SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
+                goto err;
+            }
+        } else {
+            /*
+             * Here we *must* use EVP_DigestSign() because Ed25519/Ed448
+             * does not support streaming via
+             * EVP_DigestSignUpdate/EVP_DigestSignFinal
+             */
+            if (EVP_DigestSign(mctx, NULL, &siglen, hdata, hdatalen) <= 0) {
+                SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
+                goto err;
+            }
+            sig = OPENSSL_malloc(siglen);
+            if (sig == NULL
+                    || EVP_DigestSign(mctx, sig, &siglen, hdata,
+                                      hdatalen) <= 0) {
+                SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
+                goto err;
+            }
         }
     }
 
@@ -1065,7 +1073,8 @@ WORK_STATE tls_finish_handshake(SSL *s, ossl_unused WORK_STATE wst,
             s->init_buf = NULL;
         }
 
-        if (!ssl_free_wbio_buffer(s)) {
+        /* A held client Finished still needs the buffering BIO */
+        if (!s->finished_held && !ssl_free_wbio_buffer(s)) {
             SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
             return WORK_ERROR;
         }
@@ -1534,7 +1543,7 @@ static int is_tls13_capable(const SSL *s)
         return 1;
 
 #ifndef OPENSSL_NO_PSK
-    if (s->psk_server_callback != NULL)
+    if (s->psk_server_callback != NULL || s->ctx->psk_store != NULL)
         return 1;
 #endif
 
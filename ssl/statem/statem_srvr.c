@@ -1601,8 +1601,12 @@ static int tls_early_post_process_client_hello(SSL *s)
     DOWNGRADE dgrd = DOWNGRADE_NONE;
 
     /* Finished parsing the ClientHello, now we can start processing it */
-    /* Give the ClientHello callback a crack at things */
-    if (s->ctx->client_hello_cb != NULL) {
+    /*
+     * Give the ClientHello callback a crack at things, unless it already
+     * accepted this ClientHello before a session lookup suspended us
+     */
+    if (s->ctx->client_hello_cb != NULL
+            && s->sess_lookup.state == SSL_SESS_LOOKUP_NONE) {
         /* A failure in the ClientHello callback terminates the connection. */
         switch (s->ctx->client_hello_cb(s, &al, s->ctx->client_hello_cb_arg)) {
         case SSL_CLIENT_HELLO_SUCCESS:
@@ -1694,6 +1698,14 @@ static int tls_early_post_process_client_hello(SSL *s)
         }
     }
 
+    /*
+     * The version is chosen again for the ClientHello that follows an HRR,
+     * and when processing restarts after a session lookup
+     */
+    if (s->hello_retry_request != SSL_HRR_PENDING
+            && s->sess_lookup.state == SSL_SESS_LOOKUP_NONE)
+        ssl_neg_stats_count(s, SSL_NEG_STAT_VERSION, s->version);
+
     s->hit = 0;
 
     if (!ssl_cache_cipherlist(s, &clienthello->ciphersuites,
@@ -1788,6 +1800,19 @@ static int tls_early_post_process_client_hello(SSL *s)
         }
     } else {
         i = ssl_get_prev_session(s, clienthello);
+        if (i != -1 && s->sess_lookup.state == SSL_SESS_LOOKUP_PENDING) {
+            /*
+             * The application looks the session up asynchronously. Processing
+             * of the ClientHello restarts once it supplies the result, so
+             * the extensions parsed so far must be parsed again.
+             */
+            for (loop = 0; loop < clienthello->pre_proc_exts_len; loop++)
+                clienthello->pre_proc_exts[loop].parsed = 0;
+            sk_SSL_CIPHER_free(ciphers);
+            sk_SSL_CIPHER_free(scsvs);
+            s->rwstate = SSL_SESSION_LOOKUP;
+            return -1;
+        }
         if (i == 1) {
             /* previous session */
             s->hit = 1;
@@ -2042,6 +2067,7 @@ static int tls_early_post_process_client_hello(SSL *s)
     OPENSSL_free(clienthello->pre_proc_exts);
     OPENSSL_free(s->clienthello);
     s->clienthello = NULL;
+    ssl_sess_lookup_clear(s);
     return 1;
  err:
     sk_SSL_CIPHER_free(ciphers);
@@ -2049,6 +2075,7 @@ static int tls_early_post_process_client_hello(SSL *s)
     OPENSSL_free(clienthello->pre_proc_exts);
     OPENSSL_free(s->clienthello);
     s->clienthello = NULL;
+    ssl_sess_lookup_clear(s);
 
     return 0;
 }
@@ -2060,6 +2087,15 @@ static int tls_early_post_process_client_hello(SSL *s)
 static int tls_handle_status_request(SSL *s)
 {
     s->ext.status_expected = 0;
+    ssl_ocsp_staple_free(s->ext.ocsp.staple);
+    s->ext.ocsp.staple = NULL;
+
+    /* A response from the stapling cache takes precedence */
+    if (s->ext.status_type != TLSEXT_STATUSTYPE_nothing && s->ctx != NULL
+            && s->s3.tmp.cert != NULL && ssl_ocsp_cache_get(s)) {
+        s->ext.status_expected = 1;
+        return 1;
+    }
 
     /*
      * If status request then ask callback what to do. Note: this must be
@@ -2525,6 +2561,7 @@ int tls_construct_server_key_exchange(SSL *s, WPACKET *pkt)
         }
         /* Cache the group used in the SSL_SESSION */
         s->session->kex_group = curve_id;
+        ssl_neg_stats_count(s, SSL_NEG_STAT_GROUP, curve_id);
         /* Generate a new key for this curve */
         s->s3.tmp.pkey = ssl_generate_pkey_group(s, curve_id);
         if (s->s3.tmp.pkey == NULL) {
@@ -2666,7 +2703,7 @@ int tls_construct_server_key_exchange(SSL *s, WPACKET *pkt)
     if (lu != NULL) {
         EVP_PKEY *pkey = s->s3.tmp.cert->privatekey;
         const EVP_MD *md;
-        unsigned char *sigbytes1, *sigbytes2, *tbs;
+        unsigned char *sigbytes1, *sigbytes2, *tbs, *sig;
         size_t siglen = 0, tbslen;
 
         if (pkey == NULL || !tls1_lookup_md(s->ctx, lu, &md)) {
@@ -2685,20 +2722,6 @@ int tls_construct_server_key_exchange(SSL *s, WPACKET *pkt)
             goto err;
         }
 
-        if (EVP_DigestSignInit_ex(md_ctx, &pctx,
-                                  md == NULL ? NULL : EVP_MD_get0_name(md),
-                                  s->ctx->libctx, s->ctx->propq, pkey,
-                                  NULL) <= 0) {
-            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
-            goto err;
-        }
-        if (lu->sig == EVP_PKEY_RSA_PSS) {
-            if (EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PSS_PADDING) <= 0
-                || EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx, RSA_PSS_SALTLEN_DIGEST) <= 0) {
-                SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
-                goto err;
-            }
-        }
         tbslen = construct_key_exchange_tbs(s, &tbs,
                                             s->init_buf->data + paramoffset,
                                             paramlen);
@@ -2707,16 +2730,47 @@ int tls_construct_server_key_exchange(SSL *s, WPACKET *pkt)
             goto err;
         }
 
-        if (EVP_DigestSign(md_ctx, NULL, &siglen, tbs, tbslen) <=0
-                || !WPACKET_sub_reserve_bytes_u16(pkt, siglen, &sigbytes1)
-                || EVP_DigestSign(md_ctx, sigbytes1, &siglen, tbs, tbslen) <= 0
-                || !WPACKET_sub_allocate_bytes_u16(pkt, siglen, &sigbytes2)
-                || sigbytes1 != sigbytes2) {
+        if (ssl_presign_sign(s, lu, pkey, md, tbs, tbslen, &sig, &siglen)) {
+            /* Signed with a precomputed nonce */
+            OPENSSL_free(tbs);
+            if (!WPACKET_sub_memcpy_u16(pkt, sig, siglen)) {
+                OPENSSL_free(sig);
+                SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+                goto err;
+            }
+            OPENSSL_free(sig);
+        } else {
+            if (EVP_DigestSignInit_ex(md_ctx, &pctx,
+                                      md == NULL ? NULL : EVP_MD_get0_name(md),
+                                      s->ctx->libctx, s->ctx->propq, pkey,
+                                      NULL) <= 0) {
+                OPENSSL_free(tbs);
+                SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+                goto err;
+            }
+            if (lu->sig == EVP_PKEY_RSA_PSS) {
+                if (EVP_PKEY_CTX_set_rsa_padding(pctx,
+                                                 RSA_PKCS1_PSS_PADDING) <= 0
+                    || EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx,
+                                                RSA_PSS_SALTLEN_DIGEST) <= 0) {
+                    OPENSSL_free(tbs);
+                    SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
+                    goto err;
+                }
+            }
+            if (EVP_DigestSign(md_ctx, NULL, &siglen, tbs, tbslen) <=0
+                    || !WPACKET_sub_reserve_bytes_u16(pkt, siglen, &sigbytes1)
+                    || EVP_DigestSign(md_ctx, sigbytes1, &siglen, tbs,
+                                      tbslen) <= 0
+                    || !WPACKET_sub_allocate_bytes_u16(pkt, siglen,
+                                                       &sigbytes2)
+                    || sigbytes1 != sigbytes2) {
+                OPENSSL_free(tbs);
+                SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+                goto err;
+            }
             OPENSSL_free(tbs);
-            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
-            goto err;
         }
-        OPENSSL_free(tbs);
     }
 
     ret = 1;
@@ -2808,8 +2862,9 @@ static int tls_process_cke_psk_preamble(SSL *s, PACKET *pkt)
 {
 #ifndef OPENSSL_NO_PSK
     unsigned char psk[PSK_MAX_PSK_LEN];
-    size_t psklen;
+    size_t psklen = 0;
     PACKET psk_identity;
+    const SSL_CIPHER *psk_cipher;
 
     if (!PACKET_get_length_prefixed_2(pkt, &psk_identity)) {
         SSLfatal(s, SSL_AD_DECODE_ERROR, SSL_R_LENGTH_MISMATCH);
@@ -2819,7 +2874,7 @@ static int tls_process_cke_psk_preamble(SSL *s, PACKET *pkt)
         SSLfatal(s, SSL_AD_DECODE_ERROR, SSL_R_DATA_LENGTH_TOO_LONG);
         return 0;
     }
-    if (s->psk_server_callback == NULL) {
+    if (s->psk_server_callback == NULL && s->ctx->psk_store == NULL) {
         SSLfatal(s, SSL_AD_INTERNAL_ERROR, SSL_R_PSK_NO_SERVER_CB);
         return 0;
     }
@@ -2829,8 +2884,18 @@ static int tls_process_cke_psk_preamble(SSL *s, PACKET *pkt)
         return 0;
     }
 
-    psklen = s->psk_server_callback(s, s->session->psk_identity,
-                                    psk, sizeof(psk));
+    if (ssl_psk_store_find(s, PACKET_data(&psk_identity),
+                           PACKET_remaining(&psk_identity), psk, &psklen,
+                           &psk_cipher)) {
+        /* A PSK bound to another ciphersuite counts as unknown */
+        if (psk_cipher != NULL && psk_cipher != s->s3.tmp.new_cipher) {
+            OPENSSL_cleanse(psk, psklen);
+            psklen = 0;
+        }
+    } else if (s->psk_server_callback != NULL) {
+        psklen = s->psk_server_callback(s, s->session->psk_identity,
+                                        psk, sizeof(psk));
+    }
 
     if (psklen > PSK_MAX_PSK_LEN) {
         SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
@@ -3568,6 +3633,7 @@ MSG_PROCESS_RETURN tls_process_client_certificate(SSL *s, PACKET *pkt)
         s->session = new_sess;
     }
 
+    ssl_peer_pool_release(s->session);
     X509_free(s->session->peer);
     s->session->peer = sk_X509_shift(sk);
     s->session->verify_result = s->verify_result;
@@ -3575,6 +3641,7 @@ MSG_PROCESS_RETURN tls_process_client_certificate(SSL *s, PACKET *pkt)
     sk_X509_pop_free(s->session->peer_chain, X509_free);
     s->session->peer_chain = sk;
     sk = NULL;
+    ssl_peer_pool_intern(s->session_ctx, s->session);
 
     /*
      * Freeze the handshake buffer. For <TLS1.3 we do this after the CKE
@@ -3678,6 +3745,65 @@ static int create_ticket_prequel(SSL *s, WPACKET *pkt, uint32_t age_add,
     return 1;
 }
 
+/*
+ * Seals the encoded session |senc| of |slen| bytes in a single pass with the
+ * built-in AEAD key: key name, nonce, ciphertext and tag, with the key name
+ * as additional data. Unlike the legacy format there is no padding and no
+ * separate MAC.
+ */
+static int construct_aead_ticket(SSL *s, WPACKET *pkt, uint32_t age_add,
+                                 unsigned char *tick_nonce,
+                                 const unsigned char *senc, int slen)
+{
+    SSL_CTX *tctx = s->session_ctx;
+    const EVP_CIPHER *cipher = tctx->ext.tick_aead;
+    size_t taglen = tctx->ext.tick_aead_taglen;
+    int ivlen = EVP_CIPHER_get_iv_length(cipher);
+    EVP_CIPHER_CTX *ctx;
+    unsigned char *iv, *encdata1, *encdata2, *tag;
+    int len, lenfinal, ok = 0;
+
+    if ((ctx = EVP_CIPHER_CTX_new()) == NULL) {
+        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+
+    if (!create_ticket_prequel(s, pkt, age_add, tick_nonce)) {
+        /* SSLfatal() already called */
+        goto err;
+    }
+
+    if (ivlen <= 0
+            || !WPACKET_memcpy(pkt, tctx->ext.tick_aead_key_name,
+                               sizeof(tctx->ext.tick_aead_key_name))
+            || !WPACKET_allocate_bytes(pkt, ivlen, &iv)
+            || RAND_bytes_ex(s->ctx->libctx, iv, ivlen, 0) <= 0
+            || !EVP_EncryptInit_ex(ctx, cipher, NULL,
+                                   tctx->ext.secure->tick_aead_key, iv)
+            || !EVP_EncryptUpdate(ctx, NULL, &len, tctx->ext.tick_aead_key_name,
+                                  sizeof(tctx->ext.tick_aead_key_name))
+            || !WPACKET_reserve_bytes(pkt, slen + EVP_MAX_BLOCK_LENGTH,
+                                      &encdata1)
+            || !EVP_EncryptUpdate(ctx, encdata1, &len, senc, slen)
+            || !EVP_EncryptFinal_ex(ctx, encdata1 + len, &lenfinal)
+            || len + lenfinal != slen
+            || !WPACKET_allocate_bytes(pkt, slen, &encdata2)
+            || encdata1 != encdata2
+            || !WPACKET_allocate_bytes(pkt, taglen, &tag)
+            || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, (int)taglen,
+                                   tag) <= 0
+            /* Close the sub-packet created by create_ticket_prequel() */
+            || !WPACKET_close(pkt)) {
+        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+        goto err;
+    }
+
+    ok = 1;
+ err:
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
 /*
  * Returns 1 on success, 0 to abort construction of the ticket (non-fatal), or
  * -1 on fatal error
@@ -3806,6 +3932,10 @@ static int construct_stateless_ticket(SSL *s, WPACKET *pkt, uint32_t age_add,
             SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
             goto err;
         }
+    } else if (tctx->ext.tick_aead != NULL) {
+        ok = construct_aead_ticket(s, pkt, age_add, tick_nonce, senc, slen)
+             ? 1 : -1;
+        goto err;
     } else {
         EVP_CIPHER *cipher = EVP_CIPHER_fetch(s->ctx->libctx, "AES-256-CBC",
                                               s->ctx->propq);
@@ -4056,9 +4186,15 @@ int tls_construct_new_session_ticket(SSL *s, WPACKET *pkt)
  */
 int tls_construct_cert_status_body(SSL *s, WPACKET *pkt)
 {
+    const unsigned char *resp = s->ext.ocsp.resp;
+    size_t resp_len = s->ext.ocsp.resp_len;
+
+    if (s->ext.ocsp.staple != NULL) {
+        resp = s->ext.ocsp.staple->resp;
+        resp_len = s->ext.ocsp.staple->resp_len;
+    }
     if (!WPACKET_put_bytes_u8(pkt, s->ext.status_type)
-            || !WPACKET_sub_memcpy_u24(pkt, s->ext.ocsp.resp,
-                                       s->ext.ocsp.resp_len)) {
+            || !WPACKET_sub_memcpy_u24(pkt, resp, resp_len)) {
         SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
         return 0;
     }
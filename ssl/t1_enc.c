@@ -21,30 +21,169 @@
 #include <openssl/core_names.h>
 #include <openssl/trace.h>
 
-/* seed1 through seed5 are concatenated */
-static int tls1_PRF(SSL *s,
-                    const void *seed1, size_t seed1_len,
-                    const void *seed2, size_t seed2_len,
-                    const void *seed3, size_t seed3_len,
-                    const void *seed4, size_t seed4_len,
-                    const void *seed5, size_t seed5_len,
-                    const unsigned char *sec, size_t slen,
-                    unsigned char *out, size_t olen, int fatal)
+/*
+ * Returns an HMAC context for |md| keyed with |sec|. The context keyed with
+ * the master secret is kept in |s| for the key block and Finished computations
+ * that follow; any other is owned by the caller, as indicated by |*owned|.
+ */
+static EVP_MAC_CTX *tls1_PRF_hmac(SSL *s, const EVP_MD *md,
+                                  const unsigned char *sec, size_t slen,
+                                  int *owned)
 {
-    const EVP_MD *md = ssl_prf_md(s);
-    EVP_KDF *kdf;
-    EVP_KDF_CTX *kctx = NULL;
-    OSSL_PARAM params[8], *p = params;
-    const char *mdname;
+    EVP_MAC *mac;
+    EVP_MAC_CTX *ctx = NULL;
+    OSSL_PARAM params[2];
+    int cache = sec == s->session->master_key
+                && slen <= sizeof(s->s3.tmp.prf_mac_key);
+
+    if (cache && s->s3.tmp.prf_mac != NULL
+            && s->s3.tmp.prf_mac_key_len == slen
+            && CRYPTO_memcmp(s->s3.tmp.prf_mac_key, sec, slen) == 0) {
+        *owned = 0;
+        return s->s3.tmp.prf_mac;
+    }
 
-    if (md == NULL) {
-        /* Should never happen */
+    mac = EVP_MAC_fetch(s->ctx->libctx, OSSL_MAC_NAME_HMAC, s->ctx->propq);
+    if (mac == NULL || (ctx = EVP_MAC_CTX_new(mac)) == NULL) {
+        EVP_MAC_free(mac);
+        return NULL;
+    }
+    EVP_MAC_free(mac);
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 (char *)EVP_MD_get0_name(md),
+                                                 0);
+    params[1] = OSSL_PARAM_construct_end();
+    if (!EVP_MAC_init(ctx, sec, slen, params)) {
+        EVP_MAC_CTX_free(ctx);
+        return NULL;
+    }
+
+    *owned = !cache;
+    if (cache) {
+        EVP_MAC_CTX_free(s->s3.tmp.prf_mac);
+        s->s3.tmp.prf_mac = ctx;
+        memcpy(s->s3.tmp.prf_mac_key, sec, slen);
+        s->s3.tmp.prf_mac_key_len = slen;
+    }
+    return ctx;
+}
+
+/*
+ * Computes one HMAC of P_hash: HMAC(secret, |a| + seeds). |key| is the keyed
+ * context from tls1_PRF_hmac(), which is copied so that it is never changed.
+ */
+static int tls1_PRF_hbelt_block(EVP_MAC_CTX *key,
+                                const unsigned char *a, size_t alen,
+                                const void **seed, const size_t *seed_len,
+                                size_t nseed, unsigned char *out,
+                                size_t *outlen, size_t outsize)
+{
+    EVP_MAC_CTX *ctx;
+    size_t i;
+    int ret = 0;
+
+    if ((ctx = EVP_MAC_CTX_dup(key)) == NULL)
+        return 0;
+    if (alen > 0 && !EVP_MAC_update(ctx, a, alen))
+        goto err;
+    for (i = 0; i < nseed; i++)
+        if (seed_len[i] > 0 && !EVP_MAC_update(ctx, seed[i], seed_len[i]))
+            goto err;
+    ret = EVP_MAC_final(ctx, out, outlen, outsize);
+ err:
+    EVP_MAC_CTX_free(ctx);
+    return ret;
+}
+
+/*
+ * P_hash of RFC 5246 for the BTLS suites, whose PRF is HMAC-hbelt. HMAC is
+ * keyed once and every block starts from a copy of the keyed context,
+ * rather than rekeying as the generic TLS1-PRF KDF does for each one.
+ */
+static int tls1_PRF_hbelt(SSL *s, const EVP_MD *md,
+                          const void *seed1, size_t seed1_len,
+                          const void *seed2, size_t seed2_len,
+                          const void *seed3, size_t seed3_len,
+                          const void *seed4, size_t seed4_len,
+                          const void *seed5, size_t seed5_len,
+                          const unsigned char *sec, size_t slen,
+                          unsigned char *out, size_t olen, int fatal)
+{
+    const void *seed[5];
+    size_t seed_len[5];
+    unsigned char a[EVP_MAX_MD_SIZE], chunk[EVP_MAX_MD_SIZE];
+    size_t alen, chunklen, n;
+    EVP_MAC_CTX *key;
+    int owned = 0, ret = 0;
+
+    seed[0] = seed1;
+    seed_len[0] = seed1_len;
+    seed[1] = seed2;
+    seed_len[1] = seed2_len;
+    seed[2] = seed3;
+    seed_len[2] = seed3_len;
+    seed[3] = seed4;
+    seed_len[3] = seed4_len;
+    seed[4] = seed5;
+    seed_len[4] = seed5_len;
+
+    if ((key = tls1_PRF_hmac(s, md, sec, slen, &owned)) == NULL)
+        goto err;
+
+    /* A(1) = HMAC(secret, seed) */
+    if (!tls1_PRF_hbelt_block(key, NULL, 0, seed, seed_len, OSSL_NELEM(seed),
+                              a, &alen, sizeof(a)))
+        goto err;
+
+    for (;;) {
+        /* HMAC(secret, A(i) + seed) */
+        if (!tls1_PRF_hbelt_block(key, a, alen, seed, seed_len,
+                                  OSSL_NELEM(seed), chunk, &chunklen,
+                                  sizeof(chunk)))
+            goto err;
+        n = olen < chunklen ? olen : chunklen;
+        memcpy(out, chunk, n);
+        out += n;
+        olen -= n;
+        if (olen == 0)
+            break;
+
+        /* A(i + 1) = HMAC(secret, A(i)) */
+        if (!tls1_PRF_hbelt_block(key, a, alen, NULL, NULL, 0,
+                                  a, &alen, sizeof(a)))
+            goto err;
+    }
+    ret = 1;
+
+ err:
+    if (!ret) {
         if (fatal)
             SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
         else
             ERR_raise(ERR_LIB_SSL, ERR_R_INTERNAL_ERROR);
-        return 0;
     }
+    OPENSSL_cleanse(a, sizeof(a));
+    OPENSSL_cleanse(chunk, sizeof(chunk));
+    if (owned)
+        EVP_MAC_CTX_free(key);
+    return ret;
+}
+
+/* seed1 through seed5 are concatenated */
+static int tls1_PRF_kdf(SSL *s, const EVP_MD *md,
+                        const void *seed1, size_t seed1_len,
+                        const void *seed2, size_t seed2_len,
+                        const void *seed3, size_t seed3_len,
+                        const void *seed4, size_t seed4_len,
+                        const void *seed5, size_t seed5_len,
+                        const unsigned char *sec, size_t slen,
+                        unsigned char *out, size_t olen, int fatal)
+{
+    EVP_KDF *kdf;
+    EVP_KDF_CTX *kctx = NULL;
+    OSSL_PARAM params[8], *p = params;
+    const char *mdname;
+
     kdf = EVP_KDF_fetch(s->ctx->libctx, OSSL_KDF_NAME_TLS1_PRF, s->ctx->propq);
     if (kdf == NULL)
         goto err;
@@ -83,6 +222,106 @@ static int tls1_PRF(SSL *s,
     return 0;
 }
 
+/*
+ * Known answer check of tls1_PRF_hbelt() against the TLS1-PRF KDF, for the
+ * shapes of the master secret, the key block and the Finished. The fixed
+ * inputs only need to be the same for both.
+ */
+static int tls1_PRF_hbelt_check(SSL *s, const EVP_MD *md)
+{
+    static const struct {
+        const char *label;
+        size_t label_len, seed_len, olen;
+    } kat[] = {
+        { TLS_MD_MASTER_SECRET_CONST, TLS_MD_MASTER_SECRET_CONST_SIZE,
+          2 * SSL3_RANDOM_SIZE, SSL3_MASTER_SECRET_SIZE },
+        { TLS_MD_KEY_EXPANSION_CONST, TLS_MD_KEY_EXPANSION_CONST_SIZE,
+          2 * SSL3_RANDOM_SIZE, 136 },
+        /* The Finished seed is a belt-hash of the handshake, 32 bytes */
+        { TLS_MD_CLIENT_FINISH_CONST, TLS_MD_CLIENT_FINISH_CONST_SIZE,
+          32, TLS1_FINISH_MAC_LENGTH }
+    };
+    unsigned char sec[SSL3_MASTER_SECRET_SIZE], seed[2 * SSL3_RANDOM_SIZE];
+    unsigned char out1[136], out2[136];
+    size_t i;
+    int ok = 1;
+
+    for (i = 0; i < sizeof(sec); i++)
+        sec[i] = (unsigned char)i;
+    for (i = 0; i < sizeof(seed); i++)
+        seed[i] = (unsigned char)(0xff - i);
+
+    ERR_set_mark();
+    for (i = 0; ok && i < OSSL_NELEM(kat); i++) {
+        ok = tls1_PRF_hbelt(s, md, kat[i].label, kat[i].label_len,
+                            seed, kat[i].seed_len, NULL, 0, NULL, 0,
+                            NULL, 0, sec, sizeof(sec), out1, kat[i].olen, 0)
+             && tls1_PRF_kdf(s, md, kat[i].label, kat[i].label_len,
+                             seed, kat[i].seed_len, NULL, 0, NULL, 0,
+                             NULL, 0, sec, sizeof(sec), out2, kat[i].olen, 0)
+             && CRYPTO_memcmp(out1, out2, kat[i].olen) == 0;
+    }
+    ERR_pop_to_mark();
+    return ok;
+}
+
+/*
+ * Returns 1 if tls1_PRF_hbelt() may be used. It relies on the HMAC
+ * implementation of the provider, so it is checked once per SSL_CTX.
+ */
+static int tls1_PRF_hbelt_ok(SSL *s, const EVP_MD *md)
+{
+    int ok = tsan_load(&s->ctx->hbelt_prf_ok);
+
+    if (ok == 0) {
+        ok = tls1_PRF_hbelt_check(s, md) ? 1 : -1;
+        tsan_store(&s->ctx->hbelt_prf_ok, ok);
+    }
+    return ok > 0;
+}
+
+/* seed1 through seed5 are concatenated */
+static int tls1_PRF_md(SSL *s, const EVP_MD *md,
+                       const void *seed1, size_t seed1_len,
+                       const void *seed2, size_t seed2_len,
+                       const void *seed3, size_t seed3_len,
+                       const void *seed4, size_t seed4_len,
+                       const void *seed5, size_t seed5_len,
+                       const unsigned char *sec, size_t slen,
+                       unsigned char *out, size_t olen, int fatal)
+{
+    if (md == NULL) {
+        /* Should never happen */
+        if (fatal)
+            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+        else
+            ERR_raise(ERR_LIB_SSL, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+    if (EVP_MD_get_type(md) == NID_belt_hash && tls1_PRF_hbelt_ok(s, md))
+        return tls1_PRF_hbelt(s, md, seed1, seed1_len, seed2, seed2_len,
+                              seed3, seed3_len, seed4, seed4_len,
+                              seed5, seed5_len, sec, slen, out, olen, fatal);
+    return tls1_PRF_kdf(s, md, seed1, seed1_len, seed2, seed2_len,
+                        seed3, seed3_len, seed4, seed4_len,
+                        seed5, seed5_len, sec, slen, out, olen, fatal);
+}
+
+/* PRF using the digest of the current ciphersuite */
+static int tls1_PRF(SSL *s,
+                    const void *seed1, size_t seed1_len,
+                    const void *seed2, size_t seed2_len,
+                    const void *seed3, size_t seed3_len,
+                    const void *seed4, size_t seed4_len,
+                    const void *seed5, size_t seed5_len,
+                    const unsigned char *sec, size_t slen,
+                    unsigned char *out, size_t olen, int fatal)
+{
+    return tls1_PRF_md(s, ssl_prf_md(s), seed1, seed1_len, seed2, seed2_len,
+                       seed3, seed3_len, seed4, seed4_len, seed5, seed5_len,
+                       sec, slen, out, olen, fatal);
+}
+
 static int tls1_generate_key_block(SSL *s, unsigned char *km, size_t num)
 {
     int ret;
@@ -172,6 +411,54 @@ int tls_provider_set_tls_params(SSL *s, EVP_CIPHER_CTX *ctx,
 }
 
 
+void ssl_tlstree_reset(SSL_TLSTREE *tree, uint64_t mask)
+{
+    EVP_MD_CTX_free(tree->mac_ctx);
+    tree->mac_ctx = NULL;
+    tree->mask = mask;
+    tree->leaf = 0;
+}
+
+/* Returns the TLSTREE leaf mask to use for the ciphersuite |c| */
+static uint64_t tls1_tlstree_mask(const SSL_CIPHER *c)
+{
+    if (c->algorithm_enc & SSL_KUZNYECHIK)
+        return TLSTREE_KUZNYECHIK_LEAF_MASK;
+    if (c->algorithm_enc & SSL_MAGMA)
+        return TLSTREE_MAGMA_LEAF_MASK;
+    /* Unknown tree parameters: derive the keys for every record */
+    return TLSTREE_NO_CACHE_MASK;
+}
+
+/* Keys |mac_ctx| for a record MAC of type |mac_type| with digest |m| */
+static int tls1_set_mac_key(SSL *s, EVP_MD_CTX *mac_ctx, const EVP_MD *m,
+                            int mac_type, const unsigned char *secret,
+                            size_t secret_len)
+{
+    EVP_PKEY *mac_key;
+    int ret;
+
+    if (mac_type == EVP_PKEY_HMAC) {
+        mac_key = EVP_PKEY_new_raw_private_key_ex(s->ctx->libctx, "HMAC",
+                                                  s->ctx->propq, secret,
+                                                  secret_len);
+    } else {
+        /*
+         * If its not HMAC then the only other types of MAC we support are
+         * the GOST MACs, so we need to use the old style way of creating
+         * a MAC key.
+         */
+        mac_key = EVP_PKEY_new_mac_key(mac_type, NULL, secret,
+                                       (int)secret_len);
+    }
+    ret = mac_key != NULL
+          && EVP_DigestSignInit_ex(mac_ctx, NULL, EVP_MD_get0_name(m),
+                                   s->ctx->libctx, s->ctx->propq, mac_key,
+                                   NULL) > 0;
+    EVP_PKEY_free(mac_key);
+    return ret;
+}
+
 static int tls_iv_length_within_key_block(const EVP_CIPHER *c)
 {
     /* If GCM/CCM mode only part of IV comes from PRF */
@@ -183,6 +470,170 @@ static int tls_iv_length_within_key_block(const EVP_CIPHER *c)
         return EVP_CIPHER_get_iv_length(c);
 }
 
+void ssl_key_evolution_reset(SSL_KEY_EVOLUTION *ke)
+{
+    ssl_evp_md_free(ke->prf_md);
+    ssl_evp_md_free(ke->mac_md);
+    OPENSSL_cleanse(ke, sizeof(*ke));
+}
+
+/*
+ * Records the keys just installed for the direction |which| as the root of the
+ * key evolution. Only the BELT ciphersuites use key evolution, and only if it
+ * was enabled with SSL_set_key_evolution_bits().
+ */
+static int tls1_key_evolution_setup(SSL *s, int which,
+                                    const unsigned char *ms, size_t mslen,
+                                    const unsigned char *key, size_t keylen,
+                                    const unsigned char *iv, size_t ivlen)
+{
+    SSL_KEY_EVOLUTION *ke;
+    uint32_t flag;
+
+    if (which & SSL3_CC_READ) {
+        ke = &s->key_evolution_read;
+        flag = SSL_MAC_FLAG_READ_KEY_EVOLUTION;
+    } else {
+        ke = &s->key_evolution_write;
+        flag = SSL_MAC_FLAG_WRITE_KEY_EVOLUTION;
+    }
+    ssl_key_evolution_reset(ke);
+    s->mac_flags &= ~flag;
+
+    if (s->key_evolution_bits == 0
+            || SSL_IS_DTLS(s)
+            || (s->s3.tmp.new_cipher->algorithm_enc
+                & (SSL_BELTCTR | SSL_BELTDWP)) == 0)
+        return 1;
+#ifndef OPENSSL_NO_KTLS
+    /* The kernel owns the keys, we can't change them */
+    if (((which & SSL3_CC_WRITE) && BIO_get_ktls_send(s->wbio))
+            || ((which & SSL3_CC_READ) && BIO_get_ktls_recv(s->rbio)))
+        return 1;
+#endif
+
+    if (!ossl_assert(mslen <= EVP_MAX_MD_SIZE
+                     && keylen <= EVP_MAX_KEY_LENGTH
+                     && ivlen <= EVP_MAX_IV_LENGTH)) {
+        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+    if (!ssl_evp_md_up_ref(ssl_prf_md(s))) {
+        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+    ke->prf_md = ssl_prf_md(s);
+    if (mslen > 0) {
+        if (!ssl_evp_md_up_ref(s->s3.tmp.new_hash)) {
+            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+            return 0;
+        }
+        ke->mac_md = s->s3.tmp.new_hash;
+    }
+    ke->mac_type = s->s3.tmp.new_mac_pkey_type;
+    ke->mac_secret_size = mslen;
+    ke->key_len = keylen;
+    ke->iv_len = ivlen;
+    memcpy(ke->root, ms, mslen);
+    memcpy(ke->root + mslen, key, keylen);
+    memcpy(ke->root + mslen + keylen, iv, ivlen);
+    ke->mask = ~(((uint64_t)1 << s->key_evolution_bits) - 1);
+    ke->epoch = 0;
+    s->mac_flags |= flag;
+
+    return 1;
+}
+
+/*
+ * Installs the keys for the epoch |epoch|: mac secret, key and iv are
+ * PRF(root, "btls key evolution", epoch), where epoch is the big endian
+ * masked sequence number of the first record of the epoch.
+ */
+static int tls1_key_evolution_apply(SSL *s, SSL_KEY_EVOLUTION *ke,
+                                    int sending, uint64_t epoch)
+{
+    unsigned char leaf[sizeof(ke->root)];
+    unsigned char epochbuf[8], *p = epochbuf;
+    size_t len = ke->mac_secret_size + ke->key_len + ke->iv_len;
+    EVP_CIPHER_CTX *dd = sending ? s->enc_write_ctx : s->enc_read_ctx;
+    EVP_MD_CTX *mac_ctx = NULL;
+    int ret = 0;
+
+    if (dd == NULL) {
+        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+
+    l2n8(epoch, p);
+    if (!tls1_PRF_md(s, ke->prf_md, BTLS_MD_KEY_EVOLUTION_CONST,
+                     BTLS_MD_KEY_EVOLUTION_CONST_SIZE, epochbuf,
+                     sizeof(epochbuf), NULL, 0, NULL, 0, NULL, 0,
+                     ke->root, len, leaf, len, 1)) {
+        /* SSLfatal() already called */
+        goto err;
+    }
+
+    if (ke->mac_secret_size > 0) {
+        mac_ctx = ssl_replace_hash(sending ? &s->write_hash : &s->read_hash,
+                                   NULL);
+        if (mac_ctx == NULL
+                || !tls1_set_mac_key(s, mac_ctx, ke->mac_md, ke->mac_type,
+                                     leaf, ke->mac_secret_size)) {
+            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+            goto err;
+        }
+        memcpy(sending ? s->s3.write_mac_secret : s->s3.read_mac_secret,
+               leaf, ke->mac_secret_size);
+    }
+
+    if (!EVP_CipherInit_ex(dd, NULL, NULL, leaf + ke->mac_secret_size,
+                           ke->iv_len > 0
+                               ? leaf + ke->mac_secret_size + ke->key_len
+                               : NULL,
+                           -1)) {
+        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+        goto err;
+    }
+    if (EVP_CIPHER_get0_provider(EVP_CIPHER_CTX_get0_cipher(dd)) != NULL
+            && !tls_provider_set_tls_params(s, dd,
+                                            EVP_CIPHER_CTX_get0_cipher(dd),
+                                            ke->mac_md)) {
+        /* SSLfatal already called */
+        goto err;
+    }
+
+    ke->epoch = epoch;
+    ret = 1;
+ err:
+    OPENSSL_cleanse(leaf, sizeof(leaf));
+    return ret;
+}
+
+/*
+ * Called before a record is protected or unprotected in a direction with key
+ * evolution. Rekeys if the current sequence number starts a new epoch.
+ */
+int tls1_key_evolution_check(SSL *s, int sending)
+{
+    SSL_KEY_EVOLUTION *ke;
+    unsigned char *seq;
+    uint64_t epoch;
+
+    if (sending) {
+        ke = &s->key_evolution_write;
+        seq = RECORD_LAYER_get_write_sequence(&s->rlayer);
+    } else {
+        ke = &s->key_evolution_read;
+        seq = RECORD_LAYER_get_read_sequence(&s->rlayer);
+    }
+    n2l8(seq, epoch);
+    epoch &= ke->mask;
+    if (epoch == ke->epoch)
+        return 1;
+
+    return tls1_key_evolution_apply(s, ke, sending, epoch);
+}
+
 int tls1_change_cipher_state(SSL *s, int which)
 {
     unsigned char *p, *mac_secret;
@@ -196,7 +647,6 @@ int tls1_change_cipher_state(SSL *s, int which)
     int mac_type;
     size_t *mac_secret_size;
     EVP_MD_CTX *mac_ctx;
-    EVP_PKEY *mac_key;
     size_t n, i, j, k, cl;
     int reuse_dd = 0;
 #ifndef OPENSSL_NO_KTLS
@@ -232,10 +682,13 @@ int tls1_change_cipher_state(SSL *s, int which)
             s->mac_flags |= SSL_MAC_FLAG_READ_MAC_TLSTREE;
         else
             s->mac_flags &= ~SSL_MAC_FLAG_READ_MAC_TLSTREE;
+        ssl_tlstree_reset(&s->tlstree_read,
+                          tls1_tlstree_mask(s->s3.tmp.new_cipher));
 
         if (s->enc_read_ctx != NULL) {
             reuse_dd = 1;
-        } else if ((s->enc_read_ctx = EVP_CIPHER_CTX_new()) == NULL) {
+        } else if ((s->enc_read_ctx
+                    = ssl_conn_res_take_cipher_ctx(s, 0)) == NULL) {
             SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_MALLOC_FAILURE);
             goto err;
         } else {
@@ -245,6 +698,8 @@ int tls1_change_cipher_state(SSL *s, int which)
             EVP_CIPHER_CTX_reset(s->enc_read_ctx);
         }
         dd = s->enc_read_ctx;
+        if (s->read_hash == NULL)
+            s->read_hash = ssl_conn_res_take_md_ctx(s, 0);
         mac_ctx = ssl_replace_hash(&s->read_hash, NULL);
         if (mac_ctx == NULL) {
             SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
@@ -285,9 +740,12 @@ int tls1_change_cipher_state(SSL *s, int which)
             s->mac_flags |= SSL_MAC_FLAG_WRITE_MAC_TLSTREE;
         else
             s->mac_flags &= ~SSL_MAC_FLAG_WRITE_MAC_TLSTREE;
+        ssl_tlstree_reset(&s->tlstree_write,
+                          tls1_tlstree_mask(s->s3.tmp.new_cipher));
         if (s->enc_write_ctx != NULL && !SSL_IS_DTLS(s)) {
             reuse_dd = 1;
-        } else if ((s->enc_write_ctx = EVP_CIPHER_CTX_new()) == NULL) {
+        } else if ((s->enc_write_ctx
+                    = ssl_conn_res_take_cipher_ctx(s, 1)) == NULL) {
             SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_MALLOC_FAILURE);
             goto err;
         }
@@ -300,6 +758,8 @@ int tls1_change_cipher_state(SSL *s, int which)
             }
             s->write_hash = mac_ctx;
         } else {
+            if (s->write_hash == NULL)
+                s->write_hash = ssl_conn_res_take_md_ctx(s, 1);
             mac_ctx = ssl_replace_hash(&s->write_hash, NULL);
             if (mac_ctx == NULL) {
                 SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_MALLOC_FAILURE);
@@ -361,29 +821,11 @@ int tls1_change_cipher_state(SSL *s, int which)
 
     memcpy(mac_secret, ms, i);
 
-    if (!(EVP_CIPHER_get_flags(c) & EVP_CIPH_FLAG_AEAD_CIPHER)) {
-        if (mac_type == EVP_PKEY_HMAC) {
-            mac_key = EVP_PKEY_new_raw_private_key_ex(s->ctx->libctx, "HMAC",
-                                                      s->ctx->propq, mac_secret,
-                                                      *mac_secret_size);
-        } else {
-            /*
-             * If its not HMAC then the only other types of MAC we support are
-             * the GOST MACs, so we need to use the old style way of creating
-             * a MAC key.
-             */
-            mac_key = EVP_PKEY_new_mac_key(mac_type, NULL, mac_secret,
-                                           (int)*mac_secret_size);
-        }
-        if (mac_key == NULL
-            || EVP_DigestSignInit_ex(mac_ctx, NULL, EVP_MD_get0_name(m),
-                                     s->ctx->libctx, s->ctx->propq, mac_key,
-                                     NULL) <= 0) {
-            EVP_PKEY_free(mac_key);
-            SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
-            goto err;
-        }
-        EVP_PKEY_free(mac_key);
+    if (!(EVP_CIPHER_get_flags(c) & EVP_CIPH_FLAG_AEAD_CIPHER)
+            && !tls1_set_mac_key(s, mac_ctx, m, mac_type, mac_secret,
+                                 *mac_secret_size)) {
+        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+        goto err;
     }
 
     OSSL_TRACE_BEGIN(TLS) {
@@ -511,6 +953,11 @@ int tls1_change_cipher_state(SSL *s, int which)
 
  skip_ktls:
 #endif                          /* OPENSSL_NO_KTLS */
+    if (!tls1_key_evolution_setup(s, which, ms, i, key, j, iv, k)) {
+        /* SSLfatal() already called */
+        goto err;
+    }
+
     s->statem.enc_write_state = ENC_WRITE_STATE_VALID;
 
     OSSL_TRACE_BEGIN(TLS) {
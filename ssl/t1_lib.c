@@ -1797,6 +1797,162 @@ SSL_TICKET_STATUS tls_get_ticket_from_client(SSL *s, CLIENTHELLO_MSG *hello,
                               hello->session_id, hello->session_id_len, ret);
 }
 
+/*
+ * Derives the key and key name of the AEAD ticket format from the legacy
+ * ticket keys, so that servers sharing those keys share them too. The key
+ * name differs from the legacy one, which tells the two formats apart.
+ */
+int tls_derive_aead_ticket_key(SSL_CTX *ctx)
+{
+    static const unsigned char keylabel[] = "aead ticket key";
+    static const unsigned char namelabel[] = "aead ticket name";
+    unsigned char ikm[2 * TLSEXT_TICK_KEY_LENGTH];
+    unsigned char data[sizeof(namelabel) - 1 + TLSEXT_KEYNAME_LENGTH];
+    unsigned char out[EVP_MAX_MD_SIZE];
+    size_t outlen = 0;
+    int ret = 0;
+
+    memcpy(ikm, ctx->ext.secure->tick_hmac_key, TLSEXT_TICK_KEY_LENGTH);
+    memcpy(ikm + TLSEXT_TICK_KEY_LENGTH, ctx->ext.secure->tick_aes_key,
+           TLSEXT_TICK_KEY_LENGTH);
+    memcpy(data, namelabel, sizeof(namelabel) - 1);
+    memcpy(data + sizeof(namelabel) - 1, ctx->ext.tick_key_name,
+           TLSEXT_KEYNAME_LENGTH);
+
+    if (EVP_Q_mac(ctx->libctx, "HMAC", ctx->propq, "SHA256", NULL,
+                  ikm, sizeof(ikm), keylabel, sizeof(keylabel) - 1,
+                  out, sizeof(out), &outlen) == NULL
+            || outlen < TLSEXT_TICK_KEY_LENGTH)
+        goto end;
+    memcpy(ctx->ext.secure->tick_aead_key, out, TLSEXT_TICK_KEY_LENGTH);
+
+    if (EVP_Q_mac(ctx->libctx, "HMAC", ctx->propq, "SHA256", NULL,
+                  ikm, sizeof(ikm), data, sizeof(data),
+                  out, sizeof(out), &outlen) == NULL
+            || outlen < TLSEXT_KEYNAME_LENGTH)
+        goto end;
+    memcpy(ctx->ext.tick_aead_key_name, out, TLSEXT_KEYNAME_LENGTH);
+    ret = 1;
+
+ end:
+    OPENSSL_cleanse(ikm, sizeof(ikm));
+    OPENSSL_cleanse(out, sizeof(out));
+    return ret;
+}
+
+/*
+ * Selects the AEAD that seals the session tickets issued with the built-in
+ * keys, such as "AES-256-GCM" or "belt-dwp", or the legacy CBC and HMAC
+ * format if |name| is NULL. Tickets in either format are accepted as long
+ * as the AEAD they were sealed with stays selected.
+ */
+int SSL_CTX_set_ticket_aead(SSL_CTX *ctx, const char *name)
+{
+    EVP_CIPHER *cipher = NULL;
+
+    if (name != NULL) {
+        cipher = EVP_CIPHER_fetch(ctx->libctx, name, ctx->propq);
+        if (cipher == NULL) {
+            ERR_raise(ERR_LIB_SSL, SSL_R_NO_CIPHER_MATCH);
+            return 0;
+        }
+        if ((EVP_CIPHER_get_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER) == 0
+                || EVP_CIPHER_get_key_length(cipher) != TLSEXT_TICK_KEY_LENGTH
+                || EVP_CIPHER_get_iv_length(cipher) <= 0
+                || EVP_CIPHER_get_iv_length(cipher) > EVP_MAX_IV_LENGTH) {
+            EVP_CIPHER_free(cipher);
+            ERR_raise(ERR_LIB_SSL, ERR_R_PASSED_INVALID_ARGUMENT);
+            return 0;
+        }
+    }
+
+    EVP_CIPHER_free(ctx->ext.tick_aead);
+    ctx->ext.tick_aead = cipher;
+    /* BELT-DWP produces an 8 byte tag */
+    if (cipher != NULL && EVP_CIPHER_is_a(cipher, "belt-dwp"))
+        ctx->ext.tick_aead_taglen = 8;
+    else
+        ctx->ext.tick_aead_taglen = EVP_GCM_TLS_TAG_LEN;
+    return 1;
+}
+
+/*
+ * Opens a ticket in the AEAD format: key name, nonce, ciphertext and tag,
+ * with the key name as additional data.
+ */
+static SSL_TICKET_STATUS tls_open_aead_ticket(SSL *s,
+                                              const unsigned char *etick,
+                                              size_t eticklen,
+                                              const unsigned char *sess_id,
+                                              size_t sesslen,
+                                              SSL_SESSION **psess)
+{
+    SSL_CTX *tctx = s->session_ctx;
+    const EVP_CIPHER *cipher = tctx->ext.tick_aead;
+    EVP_CIPHER_CTX *ctx = NULL;
+    SSL_TICKET_STATUS ret = SSL_TICKET_FATAL_ERR_OTHER;
+    SSL_SESSION *sess;
+    unsigned char *sdec = NULL;
+    const unsigned char *p;
+    size_t ivlen, taglen, clen;
+    int slen, declen, aadlen;
+
+    /* The AEAD the ticket was sealed with is no longer selected */
+    if (cipher == NULL)
+        return SSL_TICKET_NO_DECRYPT;
+
+    ivlen = EVP_CIPHER_get_iv_length(cipher);
+    taglen = tctx->ext.tick_aead_taglen;
+    if (eticklen <= TLSEXT_KEYNAME_LENGTH + ivlen + taglen)
+        return SSL_TICKET_NO_DECRYPT;
+    clen = eticklen - TLSEXT_KEYNAME_LENGTH - ivlen - taglen;
+
+    ctx = EVP_CIPHER_CTX_new();
+    sdec = OPENSSL_malloc(clen);
+    if (ctx == NULL || sdec == NULL) {
+        ret = SSL_TICKET_FATAL_ERR_MALLOC;
+        goto end;
+    }
+
+    if (EVP_DecryptInit_ex(ctx, cipher, NULL,
+                           tctx->ext.secure->tick_aead_key,
+                           etick + TLSEXT_KEYNAME_LENGTH) <= 0
+            || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, (int)taglen,
+                                   (void *)(etick + eticklen - taglen)) <= 0
+            || EVP_DecryptUpdate(ctx, NULL, &aadlen, etick,
+                                 TLSEXT_KEYNAME_LENGTH) <= 0
+            || EVP_DecryptUpdate(ctx, sdec, &slen,
+                                 etick + TLSEXT_KEYNAME_LENGTH + ivlen,
+                                 (int)clen) <= 0)
+        goto end;
+    if (EVP_DecryptFinal_ex(ctx, sdec + slen, &declen) <= 0) {
+        ret = SSL_TICKET_NO_DECRYPT;
+        goto end;
+    }
+    slen += declen;
+
+    p = sdec;
+    sess = d2i_SSL_SESSION(NULL, &p, slen);
+    if (sess == NULL || p != sdec + slen) {
+        SSL_SESSION_free(sess);
+        ERR_clear_error();
+        ret = SSL_TICKET_NO_DECRYPT;
+        goto end;
+    }
+    /* As for the legacy format, see tls_decrypt_ticket() */
+    if (sesslen) {
+        memcpy(sess->session_id, sess_id, sesslen);
+        sess->session_id_length = sesslen;
+    }
+    *psess = sess;
+    ret = SSL_IS_TLS13(s) ? SSL_TICKET_SUCCESS_RENEW : SSL_TICKET_SUCCESS;
+
+ end:
+    EVP_CIPHER_CTX_free(ctx);
+    OPENSSL_free(sdec);
+    return ret;
+}
+
 /*-
  * tls_decrypt_ticket attempts to decrypt a session ticket.
  *
@@ -1860,6 +2016,19 @@ SSL_TICKET_STATUS tls_decrypt_ticket(SSL *s, const unsigned char *etick,
         goto end;
     }
 
+    /* Tickets sealed with the built-in AEAD key */
+#ifndef OPENSSL_NO_DEPRECATED_3_0
+    if (tctx->ext.ticket_key_evp_cb == NULL && tctx->ext.ticket_key_cb == NULL
+#else
+    if (tctx->ext.ticket_key_evp_cb == NULL
+#endif
+            && memcmp(etick, tctx->ext.tick_aead_key_name,
+                      TLSEXT_KEYNAME_LENGTH) == 0) {
+        ret = tls_open_aead_ticket(s, etick, eticklen, sess_id, sesslen,
+                                   &sess);
+        goto end;
+    }
+
     /* Initialize session ticket encryption and HMAC contexts */
     hctx = ssl_hmac_new(tctx);
     if (hctx == NULL) {
@@ -2604,15 +2773,14 @@ int tls1_set_sigalgs(CERT *c, const int *psig_nids, size_t salglen, int client)
     return 0;
 }
 
-static int tls1_check_sig_alg(SSL *s, X509 *x, int default_nid)
+static int tls1_check_sig_nid(SSL *s, int sig_nid, int default_nid)
 {
-    int sig_nid, use_pc_sigalgs = 0;
+    int use_pc_sigalgs = 0;
     size_t i;
     const SIGALG_LOOKUP *sigalg;
     size_t sigalgslen;
     if (default_nid == -1)
         return 1;
-    sig_nid = X509_get_signature_nid(x);
     if (default_nid)
         return sig_nid == default_nid ? 1 : 0;
 
@@ -2637,6 +2805,11 @@ static int tls1_check_sig_alg(SSL *s, X509 *x, int default_nid)
     return 0;
 }
 
+static int tls1_check_sig_alg(SSL *s, X509 *x, int default_nid)
+{
+    return tls1_check_sig_nid(s, X509_get_signature_nid(x), default_nid);
+}
+
 /* Check to see if a certificate issuer name matches list of CA names */
 static int ssl_check_ca_name(STACK_OF(X509_NAME) *names, X509 *x)
 {
@@ -2675,6 +2848,7 @@ int tls1_check_chain(SSL *s, X509 *x, EVP_PKEY *pk, STACK_OF(X509) *chain,
     CERT_PKEY *cpk = NULL;
     CERT *c = s->cert;
     uint32_t *pvalid;
+    uint32_t static_flags = 0;
     unsigned int suiteb_flags = tls1_suiteb(s);
     /* idx == -1 means checking server chains */
     if (idx != -1) {
@@ -2692,6 +2866,7 @@ int tls1_check_chain(SSL *s, X509 *x, EVP_PKEY *pk, STACK_OF(X509) *chain,
         /* If no cert or key, forget it */
         if (!x || !pk)
             goto end;
+        static_flags = cpk->static_flags;
     } else {
         size_t certidx;
 
@@ -2797,13 +2972,29 @@ int tls1_check_chain(SSL *s, X509 *x, EVP_PKEY *pk, STACK_OF(X509) *chain,
              */
             if (find_sig_alg(s, x, pk) != NULL)
                 rv |= CERT_PKEY_EE_SIGNATURE;
-        } else if (!tls1_check_sig_alg(s, x, default_nid)) {
+        } else if ((static_flags & CERT_PKEY_STATIC_DONE) != 0
+                   ? !tls1_check_sig_nid(s, cpk->ee_sig_nid, default_nid)
+                   : !tls1_check_sig_alg(s, x, default_nid)) {
             if (!check_flags)
                 goto end;
         } else
             rv |= CERT_PKEY_EE_SIGNATURE;
         rv |= CERT_PKEY_CA_SIGNATURE;
-        for (i = 0; i < sk_X509_num(chain); i++) {
+        if ((static_flags & CERT_PKEY_STATIC_CA_SIGS) != 0) {
+            /* Only the distinct algorithms of the chain need checking */
+            for (i = 0; i < (int)cpk->ca_sig_nids_len; i++) {
+                if (!tls1_check_sig_nid(s, cpk->ca_sig_nids[i],
+                                        default_nid)) {
+                    if (check_flags) {
+                        rv &= ~CERT_PKEY_CA_SIGNATURE;
+                        break;
+                    } else
+                        goto end;
+                }
+            }
+        }
+        for (i = 0; (static_flags & CERT_PKEY_STATIC_CA_SIGS) == 0
+                    && i < sk_X509_num(chain); i++) {
             if (!tls1_check_sig_alg(s, sk_X509_value(chain, i), default_nid)) {
                 if (check_flags) {
                     rv &= ~CERT_PKEY_CA_SIGNATURE;
@@ -2818,7 +3009,8 @@ int tls1_check_chain(SSL *s, X509 *x, EVP_PKEY *pk, STACK_OF(X509) *chain,
         rv |= CERT_PKEY_EE_SIGNATURE | CERT_PKEY_CA_SIGNATURE;
  skip_sigs:
     /* Check cert parameters are consistent */
-    if (tls1_check_cert_param(s, x, 1))
+    if ((static_flags & CERT_PKEY_STATIC_EE_PARAM) != 0
+            || tls1_check_cert_param(s, x, 1))
         rv |= CERT_PKEY_EE_PARAM;
     else if (!check_flags)
         goto end;
@@ -2827,7 +3019,8 @@ int tls1_check_chain(SSL *s, X509 *x, EVP_PKEY *pk, STACK_OF(X509) *chain,
     /* In strict mode check rest of chain too */
     else if (strict_mode) {
         rv |= CERT_PKEY_CA_PARAM;
-        for (i = 0; i < sk_X509_num(chain); i++) {
+        for (i = 0; (static_flags & CERT_PKEY_STATIC_CA_PARAM) == 0
+                    && i < sk_X509_num(chain); i++) {
             X509 *ca = sk_X509_value(chain, i);
             if (!tls1_check_cert_param(s, ca, 0)) {
                 if (check_flags) {
@@ -2842,7 +3035,9 @@ int tls1_check_chain(SSL *s, X509 *x, EVP_PKEY *pk, STACK_OF(X509) *chain,
         STACK_OF(X509_NAME) *ca_dn;
         int check_type = 0;
 
-        if (EVP_PKEY_is_a(pk, "RSA"))
+        if ((static_flags & CERT_PKEY_STATIC_DONE) != 0)
+            check_type = cpk->cert_type;
+        else if (EVP_PKEY_is_a(pk, "RSA"))
             check_type = TLS_CT_RSA_SIGN;
         else if (EVP_PKEY_is_a(pk, "DSA"))
             check_type = TLS_CT_DSS_SIGN;
@@ -3392,6 +3587,7 @@ int tls_choose_sigalg(SSL *s, int fatalerrs)
     s->s3.tmp.cert = &s->cert->pkeys[sig_idx];
     s->cert->key = s->s3.tmp.cert;
     s->s3.tmp.sigalg = lu;
+    ssl_neg_stats_count(s, SSL_NEG_STAT_SIGALG, lu->sigalg);
     return 1;
 }
 
@@ -24,6 +24,23 @@ static const unsigned char label_prefix[] = { 0x74, 0x6C, 0x73, 0x31, 0x33, 0x20
 static const unsigned char label_prefix[] = "tls13 ";
 #endif
 
+/*
+ * Returns the TLSv1.3 KDF context of |s|, which is fetched on first use and
+ * then kept for all the HKDF-Expand-Label operations of the connection.
+ */
+static EVP_KDF_CTX *tls13_kdf_ctx(SSL *s)
+{
+    EVP_KDF *kdf;
+
+    if (s->tls13_kdf == NULL) {
+        kdf = EVP_KDF_fetch(s->ctx->libctx, OSSL_KDF_NAME_TLS1_3_KDF,
+                            s->ctx->propq);
+        s->tls13_kdf = EVP_KDF_CTX_new(kdf);
+        EVP_KDF_free(kdf);
+    }
+    return s->tls13_kdf;
+}
+
 /*
  * Given a |secret|; a |label| of length |labellen|; and |data| of length
  * |datalen| (e.g. typically a hash of the handshake messages), derive a new
@@ -36,8 +53,6 @@ int tls13_hkdf_expand(SSL *s, const EVP_MD *md, const unsigned char *secret,
                       const unsigned char *data, size_t datalen,
                       unsigned char *out, size_t outlen, int fatal)
 {
-    EVP_KDF *kdf = EVP_KDF_fetch(s->ctx->libctx, OSSL_KDF_NAME_TLS1_3_KDF,
-                                 s->ctx->propq);
     EVP_KDF_CTX *kctx;
     OSSL_PARAM params[7], *p = params;
     int mode = EVP_PKEY_HKDEF_MODE_EXPAND_ONLY;
@@ -45,9 +60,7 @@ int tls13_hkdf_expand(SSL *s, const EVP_MD *md, const unsigned char *secret,
     int ret;
     size_t hashlen;
 
-    kctx = EVP_KDF_CTX_new(kdf);
-    EVP_KDF_free(kdf);
-    if (kctx == NULL)
+    if ((kctx = tls13_kdf_ctx(s)) == NULL)
         return 0;
 
     if (labellen > TLS13_MAX_LABEL_LEN) {
@@ -60,12 +73,10 @@ int tls13_hkdf_expand(SSL *s, const EVP_MD *md, const unsigned char *secret,
              */
             ERR_raise(ERR_LIB_SSL, SSL_R_TLS_ILLEGAL_EXPORTER_LABEL);
         }
-        EVP_KDF_CTX_free(kctx);
         return 0;
     }
 
     if ((ret = EVP_MD_get_size(md)) <= 0) {
-        EVP_KDF_CTX_free(kctx);
         if (fatal)
             SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
         else
@@ -91,7 +102,7 @@ int tls13_hkdf_expand(SSL *s, const EVP_MD *md, const unsigned char *secret,
     *p++ = OSSL_PARAM_construct_end();
 
     ret = EVP_KDF_derive(kctx, out, outlen, params) <= 0;
-    EVP_KDF_CTX_free(kctx);
+    EVP_KDF_CTX_reset(kctx);
 
     if (ret != 0) {
         if (fatal)
@@ -330,37 +341,17 @@ int tls13_setup_key_block(SSL *s)
     return 1;
 }
 
-static int derive_secret_key_and_iv(SSL *s, int sending, const EVP_MD *md,
-                                    const EVP_CIPHER *ciph,
-                                    const unsigned char *insecret,
-                                    const unsigned char *hash,
-                                    const unsigned char *label,
-                                    size_t labellen, unsigned char *secret,
-                                    unsigned char *key, unsigned char *iv,
-                                    EVP_CIPHER_CTX *ciph_ctx)
+/*
+ * Gets the IV and tag lengths of |ciph| as used by TLSv1.3 on |s|. Returns 1
+ * on success or 0 on failure.
+ */
+static int tls13_iv_and_tag_len(SSL *s, const EVP_CIPHER *ciph, size_t *ivlen,
+                                size_t *taglen)
 {
-    size_t ivlen, keylen, taglen;
-    int hashleni = EVP_MD_get_size(md);
-    size_t hashlen;
-
-    /* Ensure cast to size_t is safe */
-    if (!ossl_assert(hashleni >= 0)) {
-        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
-        return 0;
-    }
-    hashlen = (size_t)hashleni;
-
-    if (!tls13_hkdf_expand(s, md, insecret, label, labellen, hash, hashlen,
-                           secret, hashlen, 1)) {
-        /* SSLfatal() already called */
-        return 0;
-    }
-
-    keylen = EVP_CIPHER_get_key_length(ciph);
     if (EVP_CIPHER_get_mode(ciph) == EVP_CIPH_CCM_MODE) {
         uint32_t algenc;
 
-        ivlen = EVP_CCM_TLS_IV_LEN;
+        *ivlen = EVP_CCM_TLS_IV_LEN;
         if (s->s3.tmp.new_cipher != NULL) {
             algenc = s->s3.tmp.new_cipher->algorithm_enc;
         } else if (s->session->cipher != NULL) {
@@ -374,16 +365,24 @@ static int derive_secret_key_and_iv(SSL *s, int sending, const EVP_MD *md,
             return 0;
         }
         if (algenc & (SSL_AES128CCM8 | SSL_AES256CCM8))
-            taglen = EVP_CCM8_TLS_TAG_LEN;
+            *taglen = EVP_CCM8_TLS_TAG_LEN;
          else
-            taglen = EVP_CCM_TLS_TAG_LEN;
+            *taglen = EVP_CCM_TLS_TAG_LEN;
     } else {
-        ivlen = EVP_CIPHER_get_iv_length(ciph);
-        taglen = 0;
+        *ivlen = EVP_CIPHER_get_iv_length(ciph);
+        *taglen = 0;
     }
+    return 1;
+}
 
-    if (!tls13_derive_key(s, md, secret, key, keylen)
-            || !tls13_derive_iv(s, md, secret, iv, ivlen)) {
+/* Sets up |ciph_ctx| to protect records with |key| */
+static int tls13_init_cipher_ctx(SSL *s, int sending, const EVP_CIPHER *ciph,
+                                 const unsigned char *key,
+                                 EVP_CIPHER_CTX *ciph_ctx)
+{
+    size_t ivlen, taglen;
+
+    if (!tls13_iv_and_tag_len(s, ciph, &ivlen, &taglen)) {
         /* SSLfatal() already called */
         return 0;
     }
@@ -400,6 +399,48 @@ static int derive_secret_key_and_iv(SSL *s, int sending, const EVP_MD *md,
     return 1;
 }
 
+/*
+ * Derives a traffic |secret| and its |key| and |iv|. |ciph_ctx| is then set
+ * up with them, unless it is NULL.
+ */
+static int derive_secret_key_and_iv(SSL *s, int sending, const EVP_MD *md,
+                                    const EVP_CIPHER *ciph,
+                                    const unsigned char *insecret,
+                                    const unsigned char *hash,
+                                    const unsigned char *label,
+                                    size_t labellen, unsigned char *secret,
+                                    unsigned char *key, unsigned char *iv,
+                                    EVP_CIPHER_CTX *ciph_ctx)
+{
+    size_t ivlen, keylen, taglen;
+    int hashleni = EVP_MD_get_size(md);
+    size_t hashlen;
+
+    /* Ensure cast to size_t is safe */
+    if (!ossl_assert(hashleni >= 0)) {
+        SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_EVP_LIB);
+        return 0;
+    }
+    hashlen = (size_t)hashleni;
+
+    if (!tls13_hkdf_expand(s, md, insecret, label, labellen, hash, hashlen,
+                           secret, hashlen, 1)) {
+        /* SSLfatal() already called */
+        return 0;
+    }
+
+    keylen = EVP_CIPHER_get_key_length(ciph);
+    if (!tls13_iv_and_tag_len(s, ciph, &ivlen, &taglen)
+            || !tls13_derive_key(s, md, secret, key, keylen)
+            || !tls13_derive_iv(s, md, secret, iv, ivlen)) {
+        /* SSLfatal() already called */
+        return 0;
+    }
+
+    return ciph_ctx == NULL
+           || tls13_init_cipher_ctx(s, sending, ciph, key, ciph_ctx);
+}
+
 int tls13_change_cipher_state(SSL *s, int which)
 {
 #ifdef CHARSET_EBCDIC
@@ -445,7 +486,7 @@ int tls13_change_cipher_state(SSL *s, int which)
         if (s->enc_read_ctx != NULL) {
             EVP_CIPHER_CTX_reset(s->enc_read_ctx);
         } else {
-            s->enc_read_ctx = EVP_CIPHER_CTX_new();
+            s->enc_read_ctx = ssl_conn_res_take_cipher_ctx(s, 0);
             if (s->enc_read_ctx == NULL) {
                 SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_MALLOC_FAILURE);
                 goto err;
@@ -460,7 +501,7 @@ int tls13_change_cipher_state(SSL *s, int which)
         if (s->enc_write_ctx != NULL) {
             EVP_CIPHER_CTX_reset(s->enc_write_ctx);
         } else {
-            s->enc_write_ctx = EVP_CIPHER_CTX_new();
+            s->enc_write_ctx = ssl_conn_res_take_cipher_ctx(s, 1);
             if (s->enc_write_ctx == NULL) {
                 SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_MALLOC_FAILURE);
                 goto err;
@@ -611,8 +652,19 @@ int tls13_change_cipher_state(SSL *s, int which)
     if (!(which & SSL3_CC_EARLY)) {
         md = ssl_handshake_md(s);
         cipher = s->s3.tmp.new_sym_enc;
-        if (!ssl3_digest_cached_records(s, 1)
-                || !ssl_handshake_hash(s, hashval, sizeof(hashval), &hashlen)) {
+        if (!ssl3_digest_cached_records(s, 1)) {
+            /* SSLfatal() already called */;
+            goto err;
+        }
+        if (label == client_handshake_traffic) {
+            /* The saved hash is used, only its length is needed */
+            if (EVP_MD_get_size(md) <= 0) {
+                SSLfatal(s, SSL_AD_INTERNAL_ERROR, ERR_R_INTERNAL_ERROR);
+                goto err;
+            }
+            hashlen = (size_t)EVP_MD_get_size(md);
+        } else if (!ssl_handshake_hash(s, hashval, sizeof(hashval),
+                                       &hashlen)) {
             /* SSLfatal() already called */;
             goto err;
         }
@@ -647,13 +699,54 @@ int tls13_change_cipher_state(SSL *s, int which)
     if(!ossl_assert(cipher != NULL))
         goto err;
 
-    if (!derive_secret_key_and_iv(s, which & SSL3_CC_WRITE, md, cipher,
-                                  insecret, hash, label, labellen, secret, key,
-                                  iv, ciph_ctx)) {
+    if (s->tls13_next_keys.label == label) {
+        /* Derived when the server side of this epoch changed keys */
+        memcpy(secret, s->tls13_next_keys.secret, hashlen);
+        memcpy(key, s->tls13_next_keys.key, sizeof(key));
+        memcpy(iv, s->tls13_next_keys.iv, EVP_MAX_IV_LENGTH);
+        OPENSSL_cleanse(&s->tls13_next_keys, sizeof(s->tls13_next_keys));
+        if (!tls13_init_cipher_ctx(s, which & SSL3_CC_WRITE, cipher, key,
+                                   ciph_ctx)) {
+            /* SSLfatal() already called */
+            goto err;
+        }
+    } else if (!derive_secret_key_and_iv(s, which & SSL3_CC_WRITE, md, cipher,
+                                         insecret, hash, label, labellen,
+                                         secret, key, iv, ciph_ctx)) {
         /* SSLfatal() already called */
         goto err;
     }
 
+    /*
+     * The client keys of an epoch come from the same secret and transcript
+     * hash as the server ones, which always change first. Derive them now
+     * in the same pass, so that the client side change needs neither
+     * another transcript hash nor another KDF setup.
+     */
+    if (label == server_handshake_traffic
+            || label == server_application_traffic) {
+        const unsigned char *nextlabel;
+        size_t nextlabellen;
+
+        if (label == server_handshake_traffic) {
+            nextlabel = client_handshake_traffic;
+            nextlabellen = sizeof(client_handshake_traffic) - 1;
+        } else {
+            nextlabel = client_application_traffic;
+            nextlabellen = sizeof(client_application_traffic) - 1;
+        }
+        s->tls13_next_keys.label = NULL;
+        if (!derive_secret_key_and_iv(s, 0, md, cipher, insecret, hash,
+                                      nextlabel, nextlabellen,
+                                      s->tls13_next_keys.secret,
+                                      s->tls13_next_keys.key,
+                                      s->tls13_next_keys.iv, NULL)) {
+            /* SSLfatal() already called */
+            goto err;
+        }
+        s->tls13_next_keys.label = nextlabel;
+    }
+
     if (label == server_application_traffic) {
         memcpy(s->server_app_traffic_secret, secret, hashlen);
         /* Now we create the exporter master secret */